@@ -5,48 +5,103 @@
 #include <algorithm>
 #include <array>
 #include <cassert>
+#include <memory>
+#include <span>
+#include <stdexcept>
+#include <utility>
 #include <vector>
 
 
+// the values either live in dat_, or the array is a view of memory that is
+// owned by someone else (eg, a mapped file), which is kept alive by owner_.
+// Copying a view is cheap and yields another view of the same memory.  Views
+// are read only: the memory may be shared with other arrays, or mapped without
+// write access.  Hence the viewed memory is only accessible as const, the
+// mutable accessors must not be used on a view, in place arithmetic throws,
+// and + and - return arrays which own their values.
 template <typename T>
 class array2D {
 public:
   using value_type = T;
   array2D() = default;
-  array2D(int64_t xs, int64_t ys, const std::vector<T>& A): size_{xs, ys}, dat_(A.begin(), A.end()) { assert(A.size() == ys * xs); }
-  array2D(int64_t xs, int64_t ys, T init = 0): size_{xs, ys}, dat_(ys * xs, init) {}
+  array2D(int64_t xs, int64_t ys, const std::vector<T>& A): size_{xs, ys}, dat_(A.begin(), A.end()), p_(dat_.data()) { assert(A.size() == ys * xs); }
+  array2D(int64_t xs, int64_t ys, T init = 0): size_{xs, ys}, dat_(ys * xs, init), p_(dat_.data()) {}
+  // view of xs*ys values at p, which remain valid as long as owner is alive
+  array2D(int64_t xs, int64_t ys, const T* p, std::shared_ptr<const void> owner): size_{xs, ys}, p_(p), owner_(std::move(owner)) {}
 
   template <typename S>
-  array2D(const array2D<S>& A): size_{A.xs(), A.ys()}, dat_(A.begin(), A.end()) {}
+  array2D(const array2D<S>& A): size_{A.xs(), A.ys()}, dat_(A.begin(), A.end()), p_(dat_.data()) {}
 
-  constexpr T& operator[](int64_t n) noexcept { return dat_[n]; }
-  constexpr T operator[](int64_t n) const noexcept { return dat_[n]; }
-  constexpr T& operator[](int64_t x, int64_t y) noexcept { return dat_[y * xs() + x]; }
-  constexpr T operator[](int64_t x, int64_t y) const noexcept { return dat_[y * xs() + x]; }
+  array2D(const array2D& A): size_(A.size_), dat_(A.dat_), p_(A.is_view() ? A.p_ : dat_.data()), owner_(A.owner_) {}
+  array2D(array2D&& A) noexcept: size_(std::exchange(A.size_, {})), dat_(std::move(A.dat_)), p_(std::exchange(A.p_, nullptr)), owner_(std::move(A.owner_)) {}
+  array2D& operator=(array2D A) noexcept {
+    std::swap(size_, A.size_);
+    std::swap(dat_, A.dat_);
+    std::swap(p_, A.p_);
+    std::swap(owner_, A.owner_);
+    return *this;
+  }
+  ~array2D() = default;
+
+  constexpr T& operator[](int64_t n) noexcept {
+    assert(!is_view());
+    return dat_[n];
+  }
+  constexpr T operator[](int64_t n) const noexcept { return p_[n]; }
+  constexpr T& operator[](int64_t x, int64_t y) noexcept {
+    assert(!is_view());
+    return dat_[y * xs() + x];
+  }
+  constexpr T operator[](int64_t x, int64_t y) const noexcept { return p_[y * xs() + x]; }
 
   constexpr auto xs() const { return size_[0]; }
   constexpr auto ys() const { return size_[1]; }
   constexpr auto size() const { return size_; }
+  constexpr bool empty() const { return xs() == 0 || ys() == 0; }
 
-  constexpr auto& data() const& { return dat_; }
-  constexpr auto&& data() && { return dat_; }
+  constexpr bool is_view() const noexcept { return p_ != nullptr && dat_.empty(); }
 
-  constexpr auto begin() { return dat_.begin(); }
-  constexpr auto begin() const { return dat_.cbegin(); }
-  constexpr auto end() { return dat_.end(); }
-  constexpr auto end() const { return dat_.cend(); }
+  constexpr std::span<T> data() noexcept {
+    assert(!is_view());
+    return dat_;
+  }
+  constexpr std::span<const T> data() const noexcept { return {p_, size_t(xs() * ys())}; }
 
-  array2D operator+(const array2D& y) const { return array2D(*this) += y; }
+  constexpr T* begin() {
+    assert(!is_view());
+    return dat_.data();
+  }
+  constexpr const T* begin() const { return p_; }
+  constexpr T* end() {
+    assert(!is_view());
+    return dat_.data() + xs() * ys();
+  }
+  constexpr const T* end() const { return p_ + xs() * ys(); }
+
+  array2D operator+(const array2D& y) const { return owned_copy() += y; }
   array2D& operator+=(const array2D& y) {
+    if (is_view())
+      throw std::logic_error("in place arithmetic on a read only view");
     std::transform(begin(), end(), y.begin(), begin(), [](auto v1, auto v2) { return v1 + v2; });
     return *this;
   }
-  array2D operator-(const array2D& y) const { return array2D(*this) -= y; }
+  array2D operator-(const array2D& y) const { return owned_copy() -= y; }
   array2D& operator-=(const array2D& y) {
+    if (is_view())
+      throw std::logic_error("in place arithmetic on a read only view");
     std::transform(begin(), end(), y.begin(), begin(), [](auto v1, auto v2) { return v1 - v2; });
     return *this;
   }
 
+  // a copy which owns its values, also of a view
+  array2D owned_copy() const {
+    if (!is_view())
+      return *this;
+    array2D res(xs(), ys());
+    std::copy(begin(), end(), res.begin());
+    return res;
+  }
+
   constexpr void transpose() {
     std::swap(size_[0], size_[1]);
     array2D<T> A(ys(), xs());
@@ -71,8 +126,10 @@ public:
 protected:
   // n: number of columns (j->n)  // x
   // m: number of rows (i->m)  // y
-  std::array<int64_t, 2> size_;
+  std::array<int64_t, 2> size_{};
   std::vector<T> dat_;
+  const T* p_ = nullptr;              // either dat_.data(), or the viewed memory
+  std::shared_ptr<const void> owner_; // keeps the viewed memory alive
 };
 
 template <typename T>
@@ -151,7 +151,7 @@ def main():
     getOSMTiles(requiredTiles)
     # print('init S:')
     # print(args.source)
-    S = ap.scene(pos, args.pos_ele, args.view_dir_h, args.view_width, args.view_dir_v, args.view_height, 1000 * args.range_km, strings2enums(args.source))
+    S = ap.scene(pos, args.pos_ele, args.view_dir_h, args.view_width, args.view_dir_v, args.view_height, 1000 * args.range_km, strings2enums(args.source), ap.tile_loading.pipelined)
     # print(S)
     C = ap.canvas_t(args.canvas_width, args.canvas_height)
     C.bucket_fill(100,100,100)
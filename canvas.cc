@@ -3,42 +3,90 @@
 #include "geometry.hh"
 #include "labelgroup.hh"
 #include "mapitems.hh"
+#include "rasterizer.hh"
 #include "scene.hh"
+#include "simd.hh"
 #include "tile.hh"
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <cmath>
+#include <exception>
+#include <fstream>
 #include <iostream>
+#include <iterator>
+#include <numbers>
+#include <numeric>
+#include <optional>
+#include <ranges>
+#include <stdexcept>
+#include <string>
 #include <tuple>
+#include <type_traits>
 #include <vector>
 
 #include <gd.h>
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 
-#pragma omp declare reduction(arraymin : array2D<float> : omp_out = pointwise_min(omp_out, omp_in)) \
-    initializer(omp_priv = array2D<float>(omp_orig))
-#pragma omp declare reduction(arraymin : array2D<double> : omp_out = pointwise_min(omp_out, omp_in)) \
-    initializer(omp_priv = array2D<double>(omp_orig))
-#pragma omp declare reduction(+ : array2D<int32_t> : omp_out += omp_in) \
-    initializer(omp_priv = array2D<int32_t>(omp_orig))
-#pragma omp declare reduction(+ : zbuffered_array<float> : omp_out += omp_in) \
-    initializer(omp_priv = zbuffered_array<float>(omp_orig))
-#pragma omp declare reduction(+ : zbuffered_array<double> : omp_out += omp_in) \
-    initializer(omp_priv = zbuffered_array<double>(omp_orig))
-
-// input in deg
 template <typename T>
-int64_t get_tile_index(const scene<T>& S, LatLon<T, Unit::deg> point) {
-  // find the tile in which the point is located, continue if none
-  const auto [lat, lon] = point;
-  auto it = std::find_if(S.tiles.begin(), S.tiles.end(), [=](const auto& tile) { return tile.first.lat() == std::floor(lat) && tile.first.lon() == std::floor(lon); });
-  const int64_t tile_index = (it != S.tiles.end()) ? std::distance(S.tiles.begin(), it) : -1;
-  if (tile_index == -1) {
-    std::cout << "tile " << int(std::floor(lat)) << "/" << int(std::floor(lon)) << " is required but seems to be inavailable." << std::endl;
-  }
-  return tile_index;
+template <typename Write>
+void canvas_t<T>::rasterize_triangle(const T x1, const T y1,
+                                     const T x2, const T y2,
+                                     const T x3, const T y3,
+                                     const int64_t x_begin, const int64_t x_end,
+                                     Write&& write) const {
+  if (raster::pixel_range(std::min({x1, x2, x3}), std::max({x1, x2, x3}), std::min({y1, y2, y3}), std::max({y1, y2, y3})).size() == 0) // smaller than a pixel, and between pixel centres
+    return;
+  const raster::triangle tri({x1, y1}, {x2, y2}, {x3, y3});
+  if (std::min(tri.xmax(), xs()) - std::max<int64_t>(tri.xmin(), 0) > xs() / 2) { // avoid drawing triangles that wrap around the edge
+    return;
+  }
+  tri.for_each_pixel(std::max<int64_t>(x_begin, 0), std::min(x_end, xs()), 0, ys(), write);
 }
 
+template <typename T>
+template <typename Write>
+void canvas_t<T>::rasterize_quad(const T x1, const T y1,
+                                 const T x2, const T y2,
+                                 const T x3, const T y3,
+                                 const T x4, const T y4,
+                                 const int64_t x_begin, const int64_t x_end,
+                                 Write&& write) const {
+  // most distant quads are smaller than a pixel, and the majority of them
+  // contains no pixel centre at all.  The others are splatted into the few
+  // pixels whose centres they may contain, with the same coverage as below.
+  const int64_t max_splat_pixels = 4;
+  const raster::pixel_range candidates(std::min({x1, x2, x3, x4}), std::max({x1, x2, x3, x4}), std::min({y1, y2, y3, y4}), std::max({y1, y2, y3, y4}));
+  if (candidates.size() == 0)
+    return;
+
+  const int64_t columns_begin = std::max<int64_t>(x_begin, 0), columns_end = std::min(x_end, xs());
+  const raster::vertex v1(x1, y1), v2(x2, y2), v3(x3, y3), v4(x4, y4);
+  const raster::edge shared(v2, v3);
+  if (candidates.size() <= max_splat_pixels) {
+    const raster::half_spaces tri1(v1, v2, v3, shared), tri2(v4, v2, v3, shared);
+    for (int64_t y = std::max<int64_t>(candidates.y0, 0); y < std::min(candidates.y1, ys()); y++) {
+      for (int64_t x = std::max(candidates.x0, columns_begin); x < std::min(candidates.x1, columns_end); x++) {
+        if (tri1.contains(x, y))
+          write(x, y, false);
+        else if (tri2.contains(x, y))
+          write(x, y, true);
+      }
+    }
+    return;
+  }
+
+  const raster::triangle tri1(v1, v2, v3, shared), tri2(v4, v2, v3, shared);
+  if (std::min(tri1.xmax(), xs()) - std::max<int64_t>(tri1.xmin(), 0) <= xs() / 2) // avoid drawing triangles that wrap around the edge
+    tri1.for_each_pixel(columns_begin, columns_end, 0, ys(), [&](int64_t x, int64_t y) { write(x, y, false); });
+  if (std::min(tri2.xmax(), xs()) - std::max<int64_t>(tri2.xmin(), 0) <= xs() / 2)
+    tri2.for_each_pixel(columns_begin, columns_end, 0, ys(), [&](int64_t x, int64_t y) { write(x, y, true); });
+}
 
 // draw that part of a triangle which is visible
 template <typename T>
@@ -46,26 +94,28 @@ void canvas_t<T>::draw_triangle(const T x1, const T y1,
                                 const T x2, const T y2,
                                 const T x3, const T y3,
                                 const T z,
-                                const colour& col) {
-  // find triangle's bb
-  const int64_t xmin = std::max<int64_t>(0, std::floor(std::min({x1, x2, x3})));
-  const int64_t xmax = std::min<int64_t>(std::ceil(std::max({x1, x2, x3})), xs());
-  const int64_t ymin = std::max<int64_t>(0, std::floor(std::min({y1, y2, y3})));
-  const int64_t ymax = std::min<int64_t>(std::ceil(std::max({y1, y2, y3})), ys());
-
-  if (xmax - xmin > xs() / 2) { // avoid drawing triangles that wrap around the edge
-    return;
-  }
+                                const colour& col,
+                                const int64_t x_begin, const int64_t x_end) {
+  rasterize_triangle(x1, y1, x2, y2, x3, y3, x_begin, x_end, [&](int64_t x, int64_t y) { write_pixel_zb(x, y, z, col); });
+}
 
-  // iterate over grid points in bb, draw the ones in the triangle
-  for (int64_t x = xmin; x < xmax; x++) {
-    for (int64_t y = ymin; y < ymax; y++) {
-      if (point_in_triangle_2<T>(x + 0.5, y + 0.5, x1, y1, x2, y2, x3, y3)) {
-        write_pixel_zb(x, y, z, col);
-      }
-    }
-  }
+template <typename T>
+void canvas_t<T>::draw_quad(const T x1, const T y1,
+                            const T x2, const T y2,
+                            const T x3, const T y3,
+                            const T x4, const T y4,
+                            const T z1, const colour& col1,
+                            const T z2, const colour& col2,
+                            const int64_t x_begin, const int64_t x_end) {
+  rasterize_quad(x1, y1, x2, y2, x3, y3, x4, y4, x_begin, x_end, [&](int64_t x, int64_t y, bool second) {
+    if (second)
+      write_pixel_zb(x, y, z2, col2);
+    else
+      write_pixel_zb(x, y, z1, col1);
+  });
 }
+template void canvas_t<float>::draw_quad(float x1, float y1, float x2, float y2, float x3, float y3, float x4, float y4, float z1, const colour& col1, float z2, const colour& col2, int64_t x_begin, int64_t x_end);
+template void canvas_t<double>::draw_quad(double x1, double y1, double x2, double y2, double x3, double y3, double x4, double y4, double z1, const colour& col1, double z2, const colour& col2, int64_t x_begin, int64_t x_end);
 
 // true if any pixel was drawn
 template <typename T>
@@ -73,22 +123,12 @@ bool canvas<T>::would_draw_triangle(const T x1, const T y1,
                                     const T x2, const T y2,
                                     const T x3, const T y3,
                                     const T z) const {
-  // find triangle's bb
-  const int64_t xmin = std::floor(std::min({x1, x2, x3}));
-  const int64_t xmax = std::ceil(std::max({x1, x2, x3}));
-  const int64_t ymin = std::floor(std::min({y1, y2, y3}));
-  const int64_t ymax = std::ceil(std::max({y1, y2, y3}));
-
   bool pixel_drawn = false;
-  // iterate over grid points in bb, draw the ones in the triangle
-  for (int64_t x = xmin; x < xmax; x++) {
-    for (int64_t y = ymin; y < ymax; y++) {
-      if (point_in_triangle_2<T>(x + 0.5, y + 0.5, x1, y1, x2, y2, x3, y3)) {
-        if (would_write_pixel_zb(x, y, z))
-          pixel_drawn = true;
-      }
-    }
-  }
+  const raster::triangle tri({x1, y1}, {x2, y2}, {x3, y3});
+  tri.for_each_pixel(0, xs(), 0, ys(), [&](int64_t x, int64_t y) {
+    if (would_write_pixel_zb(x, y, z))
+      pixel_drawn = true;
+  });
   return pixel_drawn;
 }
 
@@ -243,14 +283,270 @@ template void canvas<double>::label_axis(const scene<double>& S);
 
 
 namespace {
+constexpr double too_close_m = 100; // [m], closer quads are skipped, they cause artifacts
+constexpr double max_error_px = 1;  // [px], coarser levels are used as long as they deviate less from the full tile
+
 constexpr colour colour_scheme1(float dist) {
   return colour{uint8_t(5 * std::cbrt(dist)), 50, 150};
 }
+
+// Normals (east, north, up) of terrain point up, and they are stored as
+// (east, north) / (|east| + |north| + up), 16 bit each.  0 is no normal, it
+// marks pixels where nothing was drawn.
+template <typename T>
+uint32_t encode_normal(T east, T north, T up) {
+  const T l1 = std::abs(east) + std::abs(north) + std::abs(up);
+  if (!(l1 > 0)) // degenerate triangle
+    return encode_normal(T(0), T(0), T(1));
+  const T scale = T(32767.5) / l1;
+  const auto quantise = [&](T c) { return uint32_t(c * scale + T(32768)); }; // rounds, as c * scale + 32767.5 >= 0
+  return quantise(east) << 16 | quantise(north);
+}
+
+template <typename T>
+std::array<T, 3> decode_normal(uint32_t surface) {
+  const T east = T(surface >> 16) / T(32767.5) - 1, north = T(surface & 0xffff) / T(32767.5) - 1;
+  const T up = std::max(1 - std::abs(east) - std::abs(north), T(0));
+  const T l = std::hypot(east, north, up);
+  return {east / l, north / l, up / l};
+}
+
+// the normal of the triangle through three vertices (x, y, height), which
+// are dx and dy [m] apart along x and y.  y points south.
+template <typename T>
+uint32_t triangle_normal(T dx, T dy, int64_t x1, int64_t y1, T h1, int64_t x2, int64_t y2, T h2, int64_t x3, int64_t y3, T h3) {
+  const T a1 = (x2 - x1) * dx, a2 = (y1 - y2) * dy, a3 = h2 - h1;
+  const T b1 = (x3 - x1) * dx, b2 = (y1 - y3) * dy, b3 = h3 - h1;
+  const T up = a1 * b2 - a2 * b1, sign = up < 0 ? -1 : 1;
+  return encode_normal(sign * (a2 * b3 - a3 * b2), sign * (a3 * b1 - a1 * b3), sign * up);
+}
+
+// The largest depth in the z-buffer per column and band of band_rows rows, for
+// the columns [x_begin, x_end).  When blocks are drawn front to back, the near
+// ridges fill the z-buffer early, and later blocks whose closest point is
+// behind everything in their rectangle are hidden before they are rasterized.
+template <typename T>
+class coarse_zbuffer {
+public:
+  static constexpr int64_t band_rows = 16;
+
+  coarse_zbuffer(const array2D<T>& zb, int64_t x_begin, int64_t x_end): zb_(zb), x_begin_(x_begin),
+                                                                        z_max_(x_end - x_begin, (zb.ys() + band_rows - 1) / band_rows, std::numeric_limits<T>::max()) {}
+
+  // true if nothing in [x0, x1) x [y0, y1) is deeper than z
+  bool hides(int64_t x0, int64_t x1, int64_t y0, int64_t y1, T z) const {
+    for (int64_t b = y0 / band_rows; b <= (y1 - 1) / band_rows; b++)
+      for (int64_t x = x0; x < x1; x++)
+        if (z_max_[x - x_begin_, b] > z)
+          return false;
+    return true;
+  }
+
+  // after drawing into [x0, x1) x [y0, y1)
+  void update(int64_t x0, int64_t x1, int64_t y0, int64_t y1) {
+    for (int64_t b = y0 / band_rows; b <= (y1 - 1) / band_rows; b++) {
+      for (int64_t x = x0; x < x1; x++)
+        z_max_[x - x_begin_, b] = 0;
+      for (int64_t y = b * band_rows; y < std::min((b + 1) * band_rows, zb_.ys()); y++)
+        for (int64_t x = x0; x < x1; x++)
+          z_max_[x - x_begin_, b] = std::max(z_max_[x - x_begin_, b], zb_[x, y]);
+    }
+  }
+
+private:
+  const array2D<T>& zb_;
+  int64_t x_begin_;
+  array2D<T> z_max_; // [m], column, band
+};
 } // namespace
 
 
+// the quads of block (bx, by) at the given level of tile t, in columns [x_begin, x_end),
+// returns the number of triangles drawn
 template <typename T>
-void canvas_t<T>::render_scene(const scene<T>& S) {
+int64_t canvas_t<T>::render_block(const scene<T>& S, const int64_t t, const int level, const int64_t bx, const int64_t by, const int64_t x_begin, const int64_t x_end, const T mesh_error) {
+  const T pixels_per_rad_h = xs() / S.view_width;  // [px/rad]
+  const T pixels_per_rad_v = ys() / S.view_height; // [px/rad]
+  const auto& H = S.tiles[t].first;
+  const auto& lod = S.lods[t];
+  const auto [xst, yst] = H.size();
+  const auto& DL = level == 0 ? S.tiles[t].second : lod.distances(level);
+  const auto& P = S.projections[t].block(S, level, bx, by);
+  const int64_t inc = int64_t(1) << level; // render fewer triangles
+  const int64_t x_first = bx * lod.block_cells, y_first = by * lod.block_cells;
+  const int64_t x_last = std::min((bx + 1) * lod.block_cells, xst - 1), y_last = std::min((by + 1) * lod.block_cells, yst - 1);
+  // for the normals: heights of the level, and the spacing [m] of its
+  // vertices along meridians and, in the middle of the block, parallels
+  const auto& HL = level == 0 ? H : lod.heights(level);
+  const T dy = deg2rad_v<T> * average_radius_earth<T> / (yst - 1) * inc;
+  const T dx = dy * std::cos((H.lat() + 1 - (y_first + y_last) / T(2 * (yst - 1))) * deg2rad_v<T>);
+  // With recorded cells, the cell under the centre of a pixel of a triangle,
+  // by interpolating its vertices (x, y) in the level with the barycentric
+  // coordinates of the pixel, from their positions (h, v) [px] on the canvas.
+  const bool record_cells = !cells_.empty() || !packed_cells_.empty();
+  const auto cells_under = [&](T h1, T v1, int64_t x1, int64_t y1, T h2, T v2, int64_t x2, int64_t y2, T h3, T v3, int64_t x3, int64_t y3) {
+    const T det = (v2 - v3) * (h1 - h3) + (h3 - h2) * (v1 - v3);
+    return [=](int64_t x, int64_t y) {
+      if (!record_cells)
+        return cell_id::none;
+      const T X = x + T(0.5) - h3, Y = y + T(0.5) - v3;
+      const T l1 = det == 0 ? T(1) : std::clamp(((v2 - v3) * X + (h3 - h2) * Y) / det, T(0), T(1));
+      const T l2 = det == 0 ? T(0) : std::clamp(((v3 - v1) * X + (h1 - h3) * Y) / det, T(0), T(1) - l1);
+      const int64_t cx = std::clamp<int64_t>(std::floor((x3 + l1 * (x1 - x3) + l2 * (x2 - x3)) * inc), 0, xst - 2);
+      const int64_t cy = std::clamp<int64_t>(std::floor((y3 + l1 * (y1 - y3) + l2 * (y2 - y3)) * inc), 0, yst - 2);
+      return cell_id::make(t, cy * xst + cx);
+    };
+  };
+
+  // Neighbouring blocks may be drawn at different levels, or cut into
+  // adaptive meshes which split their common border differently, hence the
+  // border need not be the same line, and farther terrain would show through
+  // the cracks.  Below each edge on its border, a block hangs a vertical
+  // skirt, which reaches below the border of the neighbour: each block
+  // deviates from the full tile by at most max_error_px at its closest point,
+  // and the closest point of the neighbour is not farther than the farthest
+  // one of this block.  The skirts are hidden behind the terrain, except in
+  // the cracks.
+  const int64_t xl_first = x_first >> level, xl_last = x_last >> level;
+  const int64_t yl_first = y_first >> level, yl_last = y_last >> level;
+  const T skirt_m = max_error_px * (lod.min_distance(bx, by) + lod.max_distance(bx, by)) / pixels_per_rad_v;
+  const auto skirt = [&](int64_t x1, int64_t y1, int64_t x2, int64_t y2, uint32_t surface) {
+    if (!(x1 == x2 && (x1 == xl_first || x1 == xl_last)) && !(y1 == y2 && (y1 == yl_first || y1 == yl_last))) // not on the border
+      return;
+    const T d1 = DL[x1, y1], d2 = DL[x2, y2];
+    if (std::min(d1, d2) > S.view_range_m || std::min(d1, d2) < too_close_m)
+      return;
+    const T h1 = P.h_at(x1, y1) * pixels_per_rad_h, h2 = P.h_at(x2, y2) * pixels_per_rad_h; // [px]
+    if (std::max(h1, h2) < x_begin - 1 || std::min(h1, h2) > x_end + 1)
+      return;
+    // lowering a point by skirt_m turns it down by at most skirt_m / d
+    const T v1 = P.v_at(x1, y1) * pixels_per_rad_v, v2 = P.v_at(x2, y2) * pixels_per_rad_v;       // [px]
+    const T w1 = v1 + skirt_m / d1 * pixels_per_rad_v, w2 = v2 + skirt_m / d2 * pixels_per_rad_v; // [px]
+    if (std::min(v1, v2) >= ys() || std::max(w1, w2) < 0)
+      return;
+    // behind the triangles next to the edge, which are drawn at the mean distance of their vertices
+    const T dist = std::max(d1, d2) + dy;
+    const auto cells = cells_under(h1, v1, x1, y1, h2, v2, x2, y2, h1, w1, x1, y1);
+    rasterize_quad(h1, v1, h2, v2, h1, w1, h2, w2, x_begin, x_end, [&](int64_t px, int64_t py, bool) { write_surface_zb(px, py, dist, surface, cells(px, py)); });
+  };
+
+  int64_t n_triangles = 0;
+  const auto quad = [&](int64_t x, int64_t y) {
+    const int64_t xl = x >> level, yl = y >> level; // vertex in level
+    const T d_ij = DL[xl, yl];
+    if (d_ij > S.view_range_m) // too far
+      return;
+    if (d_ij < too_close_m) // too close, avoid artifacts
+      return;
+    // first triangle: y/x, y+1/x, y/x+1
+    // second triangle: y+1/x, y/x+1, y+1/x+1
+    // the angles of all four points of the two triangles are projected
+    // already, translate to image coordinates
+    const T h_ij = P.h_at(xl, yl) * pixels_per_rad_h;
+    const T h_ijj = P.h_at(xl + 1, yl) * pixels_per_rad_h;
+    const T h_iij = P.h_at(xl, yl + 1) * pixels_per_rad_h;
+    const T h_iijj = P.h_at(xl + 1, yl + 1) * pixels_per_rad_h;
+    // debug << "("<<y<<","<<x<< ") h: " << h_ij << ", " << h_ijj << ", " << h_iij << ", " << h_iijj << std::endl;
+
+    // are any points inside the canvas?
+    if (!is_in_range(h_ij, 0, xs()) && !is_in_range(h_ijj, 0, xs()) && !is_in_range(h_iij, 0, xs()) && !is_in_range(h_iijj, 0, xs())) {
+      return;
+    }
+    // does the quad reach into the columns?
+    if (std::max({h_ij, h_ijj, h_iij, h_iijj}) < x_begin - 1 || std::min({h_ij, h_ijj, h_iij, h_iijj}) > x_end + 1) {
+      return;
+    }
+
+    // there could be a check here to avoid triangles to wrap around, but
+    // it's only tested in draw_triangle
+
+    const T v_ij = P.v_at(xl, yl) * pixels_per_rad_v;         // [px]
+    const T v_ijj = P.v_at(xl + 1, yl) * pixels_per_rad_v;     // [px]
+    const T v_iij = P.v_at(xl, yl + 1) * pixels_per_rad_v;     // [px]
+    const T v_iijj = P.v_at(xl + 1, yl + 1) * pixels_per_rad_v; // [px]
+    // debug << "v: " << v_ij << ", " << v_ijj << ", " << v_iij << ", " << v_iijj << std::endl;
+
+    // like the triangles of the adaptive mesh, those which reach over the top
+    // or bottom of the canvas are clipped rather than dropped, else the rows
+    // along the border would have holes
+    const bool first = std::max({v_ij, v_ijj, v_iij}) >= 0 && std::min({v_ij, v_ijj, v_iij}) < ys();
+    const bool second = std::max({v_ijj, v_iij, v_iijj}) >= 0 && std::min({v_ijj, v_iij, v_iijj}) < ys();
+    if (!first && !second)
+      return;
+
+    // separable distances are computed on access, hence only once per vertex
+    const T d_ijj = DL[xl + 1, yl], d_iij = DL[xl, yl + 1], d_iijj = DL[xl + 1, yl + 1];
+    const T dist1 = (d_ij + d_iij + d_ijj) / 3;
+    const T dist2 = (d_iij + d_ijj + d_iijj) / 3;
+    n_triangles += int(first) + int(second);
+    const T e_ij = HL[xl, yl], e_ijj = HL[xl + 1, yl], e_iij = HL[xl, yl + 1], e_iijj = HL[xl + 1, yl + 1]; // [m], elevations
+    const uint32_t surface1 = first ? triangle_normal(dx, dy, xl, yl, e_ij, xl + 1, yl, e_ijj, xl, yl + 1, e_iij) : 0;
+    const uint32_t surface2 = second ? triangle_normal(dx, dy, xl + 1, yl, e_ijj, xl, yl + 1, e_iij, xl + 1, yl + 1, e_iijj) : 0;
+    const auto cells1 = cells_under(h_ij, v_ij, xl, yl, h_ijj, v_ijj, xl + 1, yl, h_iij, v_iij, xl, yl + 1);
+    const auto cells2 = cells_under(h_ijj, v_ijj, xl + 1, yl, h_iij, v_iij, xl, yl + 1, h_iijj, v_iijj, xl + 1, yl + 1);
+    if (first && second)
+      rasterize_quad(h_ij, v_ij, h_ijj, v_ijj, h_iij, v_iij, h_iijj, v_iijj, x_begin, x_end, [&](int64_t px, int64_t py, bool s) {
+        if (s)
+          write_surface_zb(px, py, dist2, surface2, cells2(px, py));
+        else
+          write_surface_zb(px, py, dist1, surface1, cells1(px, py));
+      });
+    else if (first)
+      rasterize_triangle(h_ij, v_ij, h_ijj, v_ijj, h_iij, v_iij, x_begin, x_end, [&](int64_t px, int64_t py) { write_surface_zb(px, py, dist1, surface1, cells1(px, py)); });
+    else if (second)
+      rasterize_triangle(h_ijj, v_ijj, h_iij, v_iij, h_iijj, v_iijj, x_begin, x_end, [&](int64_t px, int64_t py) { write_surface_zb(px, py, dist2, surface2, cells2(px, py)); });
+    // the first triangle has the north and west edge of the quad, the second one the south and east edge
+    if (first) {
+      skirt(xl, yl, xl + 1, yl, surface1);
+      skirt(xl, yl, xl, yl + 1, surface1);
+    }
+    if (second) {
+      skirt(xl, yl + 1, xl + 1, yl + 1, surface2);
+      skirt(xl + 1, yl, xl + 1, yl + 1, surface2);
+    }
+  };
+
+  // vertices in the coordinates of the block at its level.  The triangles of
+  // the adaptive mesh may be large, hence they are clipped to the canvas
+  // rather than dropped when a vertex is above or below it.
+  const auto triangle = [&](int64_t x1, int64_t y1, int64_t x2, int64_t y2, int64_t x3, int64_t y3) {
+    x1 += P.x0, x2 += P.x0, x3 += P.x0;
+    y1 += P.y0, y2 += P.y0, y3 += P.y0;
+    const T d1 = DL[x1, y1], d2 = DL[x2, y2], d3 = DL[x3, y3];
+    if (std::min({d1, d2, d3}) > S.view_range_m) // too far
+      return;
+    if (std::min({d1, d2, d3}) < too_close_m) // too close, avoid artifacts
+      return;
+    const T h1 = P.h_at(x1, y1) * pixels_per_rad_h, h2 = P.h_at(x2, y2) * pixels_per_rad_h, h3 = P.h_at(x3, y3) * pixels_per_rad_h; // [px]
+    if (!is_in_range(h1, 0, xs()) && !is_in_range(h2, 0, xs()) && !is_in_range(h3, 0, xs()))
+      return;
+    if (std::max({h1, h2, h3}) < x_begin - 1 || std::min({h1, h2, h3}) > x_end + 1)
+      return;
+    const T v1 = P.v_at(x1, y1) * pixels_per_rad_v, v2 = P.v_at(x2, y2) * pixels_per_rad_v, v3 = P.v_at(x3, y3) * pixels_per_rad_v; // [px]
+    if (std::max({v1, v2, v3}) < 0 || std::min({v1, v2, v3}) >= ys())
+      return;
+    const T dist = (d1 + d2 + d3) / 3;
+    const uint32_t surface = triangle_normal(dx, dy, x1, y1, T(HL[x1, y1]), x2, y2, T(HL[x2, y2]), x3, y3, T(HL[x3, y3]));
+    const auto cells = cells_under(h1, v1, x1, y1, h2, v2, x2, y2, h3, v3, x3, y3);
+    n_triangles++;
+    rasterize_triangle(h1, v1, h2, v2, h3, v3, x_begin, x_end, [&](int64_t x, int64_t y) { write_surface_zb(x, y, dist, surface, cells(x, y)); });
+    skirt(x1, y1, x2, y2, surface);
+    skirt(x2, y2, x3, y3, surface);
+    skirt(x3, y3, x1, y1, surface);
+  };
+
+  if (mesh_error >= 0 && x_last - x_first == lod.block_cells && y_last - y_first == lod.block_cells) {
+    S.projections[t].mesh(level, bx, by).for_each_triangle(mesh_error, triangle);
+    return n_triangles;
+  }
+  for (int64_t y = y_first; y < y_last; y += inc)
+    for (int64_t x = x_first; x < x_last; x += inc)
+      quad(x, y);
+  return n_triangles;
+}
+
+template <typename T>
+void canvas_t<T>::render_scene(const scene<T>& S, const rasterization mode, const terrain_mesh mesh, const shading& shade, const bool record_cells) {
   std::ofstream debug("debug-render_scene", std::ofstream::out | std::ofstream::app);
   // determine the dimensions, especially pixels/deg
   const T view_direction_h = S.view_dir_h;       // [rad]
@@ -267,107 +563,301 @@ void canvas_t<T>::render_scene(const scene<T>& S) {
   debug << "canvas height: " << ys() << std::endl;
   std::cout << "horizontal resolution [px/rad]: " << pixels_per_rad_h << std::endl;
   std::cout << "vertical resolution [px/rad]: " << pixels_per_rad_v << std::endl;
+  // the light is relative to that on flat terrain, which there is none of with the sun on or below the horizon
+  if (shade.hillshade > 0 && !(shade.sun_elevation > 0 && shade.sun_elevation <= 90))
+    throw std::invalid_argument("the sun elevation for hillshading must be in ]0, 90] deg, not " + std::to_string(shade.sun_elevation));
+
+  // Deferred shading: the geometry pass only finds the closest surface per
+  // pixel, its depth and normal, and the colours are resolved per pixel
+  // afterwards.  Hence overdraw costs no shading.
+  surface_ = array2D<uint32_t>(xs(), ys(), 0);
+  cells_ = array2D<uint32_t>();
+  if (record_cells) {
+    if (std::ssize(S.tiles) > cell_id::max_tiles)
+      throw std::runtime_error("cells can be recorded for at most " + std::to_string(cell_id::max_tiles) + " tiles");
+    if (std::ranges::any_of(S.tiles, [](const auto& t) { return t.first.xs() * t.first.ys() > cell_id::max_vertices; }))
+      throw std::runtime_error("cells can be recorded for tiles of at most " + std::to_string(cell_id::max_vertices) + " vertices");
+    if (mode != rasterization::shared_atomic) // else after the depths are known
+      cells_ = array2D<uint32_t>(xs(), ys(), cell_id::none);
+  }
 
-  // iterate over tiles in scene
-#pragma omp parallel for default(none)                                                                                                     \
-    shared(S, std::cout, debug, xs_, ys_, view_width, view_height, view_direction_h, view_direction_v, pixels_per_rad_h, pixels_per_rad_v) \
-    reduction(+ : buffered_canvas)
-  for (int64_t t = 0; t < std::ssize(S.tiles); t++) {
-    const auto t0 = std::chrono::high_resolution_clock::now();
-
-    const auto& H = S.tiles[t].first;
-    const auto& D = S.tiles[t].second;
-    const auto [xst, yst] = H.size();
-    // debug << "H: " << H << std::endl;
-    // debug << "D: " << D << std::endl;
-
-    debug << "ys: " << yst << std::endl;
-    debug << "xs: " << xst << std::endl;
-    debug << (yst - 1) * (xst - 1) * 2 << " triangles in tile " << t << std::endl;
-    const T pi = std::numbers::pi_v<T>;
-    const T invis_angle = std::max(2 * pi - view_width, T(0));
-    const int64_t inc = 1; // render fewer triangles
-    for (int64_t y = 0; y < yst - inc; y += inc) {
-      for (int64_t x = 0; x < xst - inc; x += inc) {
-        if (D[x, y] > S.view_range_m) // too far
-          continue;
-        if (D[x, y] < 100) // too close, avoid artifacts
+  // rasterization::binned is sort-middle: first, the lod blocks of all tiles
+  // are projected in parallel, and sorted into bins of bin_width columns of the
+  // canvas by their extent.  Then each bin is rasterized by one thread, which
+  // writes into its own columns of the one canvas only.  Hence the memory does
+  // not grow with the number of threads, and there is nothing to merge.
+  //
+  // rasterization::shared_atomic rasterizes each block right away, into one
+  // canvas of packed depth and normal which all threads update atomically.
+  // The cells do not fit into the same word, and two atomic minima of depth
+  // and normal, and depth and cell, could pick different triangles of the same
+  // depth.  Hence the cells are recorded in a second pass over the blocks,
+  // by the triangles whose depth and normal have won.
+  //
+  // Either way, the unit of work is one block, not one tile: a view often
+  // needs only a few tiles, of which the near one is most of the work.  The
+  // blocks of each tile become tasks as soon as the tile arrives, the largest
+  // first, and idle threads steal them from the others.  Hence with
+  // tile_loading::pipelined, reading tiles overlaps with all of the work of
+  // shared_atomic, but only with the projection of the bins, which are
+  // rasterized front to back once all tiles are in.
+  struct block_ref {
+    int64_t t, by, bx;
+    int level;
+    auto operator<=>(const block_ref&) const = default;
+  };
+#ifdef _OPENMP
+  const int64_t n_threads = omp_get_max_threads();
+#else
+  const int64_t n_threads = 1;
+#endif
+  // a few bins per thread, but not so narrow that most blocks fall into several
+  const int64_t bin_width = std::clamp<int64_t>(xs() / (4 * n_threads), 32, 128); // [px]
+  const int64_t n_bins = (xs() + bin_width - 1) / bin_width;
+  std::vector<std::vector<block_ref>> bins(n_bins);
+  std::vector<double> bin_cost(n_bins, 0); // estimated, quads + pixels
+  // [m], how much the adaptive mesh of a block may deviate from its level, such
+  // that both together deviate less than max_error_px from the full tile.
+  const auto mesh_error = [&](const block_ref& block) {
+    if (mesh == terrain_mesh::grid)
+      return T(-1);
+    const auto& lod = S.lods[block.t];
+    return std::max(T(max_error_px) * lod.min_distance(block.bx, block.by) / pixels_per_rad_v - lod.error(block.level, block.bx, block.by), T(0));
+  };
+  std::vector<block_ref> drawn; // by rasterization::shared_atomic, for the cells
+  if (mode == rasterization::shared_atomic) {
+    packed_.resize(xs() * ys());
+    for (int64_t y = 0; y < ys(); y++)
+      for (int64_t x = 0; x < xs(); x++)
+        packed_[y * xs() + x] = pack(zb(x, y), 0);
+  }
+
+  const auto t0 = std::chrono::high_resolution_clock::now();
+  std::exception_ptr error;
+  std::atomic<int64_t> n_triangles = 0;
+#pragma omp parallel shared(S, mode, mesh_error, bins, bin_cost, drawn, error, n_triangles)
+#pragma omp single
+  for (int64_t n = 0; n < std::ssize(S.tiles); n++) {
+    int64_t t = 0;
+    try {
+      t = S.wait_for_nth_tile(n);
+    }
+    catch (...) {
+      error = std::current_exception();
+      break;
+    }
+    // blocks in range, with the number of quads at their level, nearest and
+    // hence largest on the canvas first
+    const auto& lod = S.lods[t];
+    std::vector<std::tuple<int64_t, T, block_ref>> blocks;
+    for (int64_t by = 0; by < lod.blocks(); by++) {
+      for (int64_t bx = 0; bx < lod.blocks(); bx++) {
+        const T d = lod.min_distance(bx, by);
+        if (d > S.view_range_m) // too far
           continue;
-        // first triangle: y/x, y+1/x, y/x+1
-        // second triangle: y+1/x, y/x+1, y+1/x+1
-        // get horizontal and vertical angles for all four points of the two triangles
-        // translate to image coordinates
-        const LatLon<T, Unit::deg> target_ij(H.lat() + 1 - y / T(yst - 1), H.lon() + x / T(xst - 1));
-        const T h_ij = (std::fmod(view_direction_h + view_width / 2 + bearing(S.standpoint, target_ij.to_rad()) + T(1.5) * pi + invis_angle / 2, 2 * pi) - invis_angle / 2) * pixels_per_rad_h;
-        const LatLon<T, Unit::deg> target_ijj(H.lat() + 1 - y / T(yst - 1), H.lon() + (x + inc) / T(xst - 1));
-        const T h_ijj = (std::fmod(view_direction_h + view_width / 2 + bearing(S.standpoint, target_ijj.to_rad()) + T(1.5) * pi + invis_angle / 2, 2 * pi) - invis_angle / 2) * pixels_per_rad_h;
-        const LatLon<T, Unit::deg> target_iij(H.lat() + 1 - (y + inc) / T(yst - 1), H.lon() + x / T(xst - 1));
-        const T h_iij = (std::fmod(view_direction_h + view_width / 2 + bearing(S.standpoint, target_iij.to_rad()) + T(1.5) * pi + invis_angle / 2, 2 * pi) - invis_angle / 2) * pixels_per_rad_h;
-        const LatLon<T, Unit::deg> target_iijj(H.lat() + 1 - (y + inc) / T(yst - 1), H.lon() + (x + inc) / T(xst - 1));
-        const T h_iijj = (std::fmod(view_direction_h + view_width / 2 + bearing(S.standpoint, target_iijj.to_rad()) + T(1.5) * pi + invis_angle / 2, 2 * pi) - invis_angle / 2) * pixels_per_rad_h;
-        // debug << "("<<y<<","<<x<< ") h: " << h_ij << ", " << h_ijj << ", " << h_iij << ", " << h_iijj << std::endl;
-
-        // are any points inside the canvas?
-        if (!is_in_range(h_ij, 0, xs()) && !is_in_range(h_ijj, 0, xs()) && !is_in_range(h_iij, 0, xs()) && !is_in_range(h_iijj, 0, xs())) {
+        if (lod.max_distance(bx, by) < too_close_m) // too close
           continue;
-        }
-
-        // there could be a check here to avoid triangles to wrap around, but
-        // it's only tested in draw_triangle
-
-        // std::cout << S.z_standpoint << ", " << H(y,x) << ", " <<  D(y,x) << std::endl;
-        const T v_ij = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x, y], D[x, y])) * pixels_per_rad_v;                           // [px]
-        const T v_ijj = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x + inc, y], D[x + inc, y])) * pixels_per_rad_v;              //[px]
-        const T v_iij = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x, y + inc], D[x, y + inc])) * pixels_per_rad_v;              // [px]
-        const T v_iijj = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x + inc, y + inc], D[x + inc, y + inc])) * pixels_per_rad_v; // [px]
-        // debug << "v: " << v_ij << ", " << v_ijj << ", " << v_iij << ", " << v_iijj << std::endl;
-
-        if (!is_in_range(v_iij, 0, ys()) || !is_in_range(v_ijj, 0, ys())) {
+        const auto B = S.projections[t].bounds(S, bx, by);
+        if (B.h_max * pixels_per_rad_h < 0 || B.h_min * pixels_per_rad_h >= xs() || B.v_max * pixels_per_rad_v < 0 || B.v_min * pixels_per_rad_v >= ys()) // outside of the canvas
           continue;
+        const int level = lod.choose_level(bx, by, pixels_per_rad_v, max_error_px);
+        const int64_t cells = lod_pyramid<T>::block_cells >> level;
+        blocks.push_back({-cells * cells, d, {t, by, bx, level}});
+      }
+    }
+    std::ranges::sort(blocks);
+    for (const block_ref& block : blocks | std::views::elements<2>) {
+#pragma omp task firstprivate(block) shared(S, mode, mesh_error, bins, bin_cost, drawn, n_triangles)
+      {
+        const auto& P = S.projections[block.t].block(S, block.level, block.bx, block.by);
+        const T x_min = P.h_min * pixels_per_rad_h, x_max = P.h_max * pixels_per_rad_h;
+        const T y_min = P.v_min * pixels_per_rad_v, y_max = P.v_max * pixels_per_rad_v;
+        if (x_max >= 0 && x_min < xs() && y_max >= 0 && y_min < ys()) { // not outside of the canvas
+          if (mode == rasterization::shared_atomic) {
+            n_triangles += render_block(S, block.t, block.level, block.bx, block.by, 0, xs(), mesh_error(block));
+            if (record_cells) {
+#pragma omp critical
+              drawn.push_back(block);
+            }
+          }
+          else {
+            const int64_t first_bin = std::max<int64_t>(std::floor(x_min) - 1, 0) / bin_width;
+            const int64_t last_bin = std::min<int64_t>(std::ceil(x_max) + 1, xs() - 1) / bin_width;
+            const double quads = double(P.h.xs() - 1) * (P.h.ys() - 1) / (last_bin - first_bin + 1);
+            const double rows = std::min<T>(y_max, ys()) - std::max<T>(y_min, 0);
+#pragma omp critical
+            for (int64_t b = first_bin; b <= last_bin; b++) {
+              const double columns = std::min<T>(x_max, (b + 1) * bin_width) - std::max<T>(x_min, b * bin_width);
+              bins[b].push_back(block);
+              bin_cost[b] += quads + std::max(columns, 0.0) * rows;
+            }
+          }
         }
-
-        if (is_in_range(v_ij, 0, ys())) {
-          const T dist = (D[x, y] + D[x, y + inc] + D[x + inc, y]) / 3;
-          draw_triangle(h_ij, v_ij, h_ijj, v_ijj, h_iij, v_iij, dist, colour_scheme1(dist));
+      }
+    }
+  }
+  if (error) {
+    packed_.clear();
+    packed_cells_.clear();
+    surface_ = array2D<uint32_t>();
+    cells_ = array2D<uint32_t>();
+    std::rethrow_exception(error);
+  }
+  S.wait_for_tiles(); // all of them have arrived, this only reports the tile cache
+  const auto t1 = std::chrono::high_resolution_clock::now();
+
+  if (mode == rasterization::shared_atomic) {
+    if (record_cells) {
+      packed_cells_.assign(xs() * ys(), cell_id::none);
+#pragma omp parallel for schedule(dynamic)
+      for (int64_t i = 0; i < std::ssize(drawn); i++)
+        render_block(S, drawn[i].t, drawn[i].level, drawn[i].bx, drawn[i].by, 0, xs(), mesh_error(drawn[i]));
+      cells_ = array2D<uint32_t>(xs(), ys(), packed_cells_);
+    }
+    for (int64_t y = 0; y < ys(); y++) {
+      for (int64_t x = 0; x < xs(); x++) {
+        const uint64_t p = packed_[y * xs() + x];
+        if (p != pack(zb(x, y), 0)) {
+          zb(x, y) = std::bit_cast<float>(uint32_t(p >> 32));
+          surface_[x, y] = uint32_t(p);
         }
-
-        if (is_in_range(v_iijj, 0, ys())) {
-          const T dist = (D[x, y + inc] + D[x + inc, y] + D[x + inc, y + inc]) / 3;
-          draw_triangle(h_ijj, v_ijj, h_iij, v_iij, h_iijj, v_iijj, dist, colour_scheme1(dist));
+      }
+    }
+    packed_ = std::vector<uint64_t>();
+    packed_cells_ = std::vector<uint32_t>();
+    std::cout << "  rasterizing into the shared canvas took " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count() << " ms" << std::endl;
+  }
+  else {
+    std::cout << "  projecting and binning took " << std::chrono::duration<double, std::milli>(t1 - t0).count() << " ms" << std::endl;
+    // the most expensive bins first, such that none of them is left for last
+    std::vector<int64_t> order(n_bins);
+    std::iota(order.begin(), order.end(), 0);
+    std::ranges::sort(order, std::ranges::greater(), [&](int64_t b) { return bin_cost[b]; });
+    std::atomic<int64_t> n_hidden = 0;
+#pragma omp parallel for schedule(dynamic)
+    for (int64_t i = 0; i < n_bins; i++) {
+      const int64_t b = order[i];
+      const int64_t x_begin = b * bin_width, x_end = std::min((b + 1) * bin_width, xs());
+      int64_t n = 0, n_h = 0;
+      // front to back; the order of tasks in the first pass is random, the image should not be
+      std::ranges::sort(bins[b], {}, [&](const block_ref& block) { return std::pair(S.lods[block.t].min_distance(block.bx, block.by), block); });
+      coarse_zbuffer<T> hidden(zb(), x_begin, x_end);
+      for (const block_ref& block : bins[b]) {
+        // the pixels whose centres may be covered by the block
+        const auto& P = S.projections[block.t].block(S, block.level, block.bx, block.by);
+        const int64_t x0 = std::max<int64_t>(std::floor(P.h_min * pixels_per_rad_h) - 1, x_begin), x1 = std::min<int64_t>(std::ceil(P.h_max * pixels_per_rad_h) + 1, x_end);
+        const int64_t y0 = std::max<int64_t>(std::floor(P.v_min * pixels_per_rad_v) - 1, 0), y1 = std::min<int64_t>(std::ceil(P.v_max * pixels_per_rad_v) + 1, ys());
+        if (x0 >= x1 || y0 >= y1)
+          continue;
+        // every quad is at least as deep as the closest vertex, up to rounding
+        if (hidden.hides(x0, x1, y0, y1, S.lods[block.t].min_distance(block.bx, block.by) * T(0.999))) {
+          n_h++;
+          continue;
         }
+        n += render_block(S, block.t, block.level, block.bx, block.by, x_begin, x_end, mesh_error(block));
+        hidden.update(x0, x1, y0, y1);
       }
+      n_triangles += n;
+      n_hidden += n_h;
     }
-
-    auto t1 = std::chrono::high_resolution_clock::now();
-    std::chrono::duration<double, std::milli> fp_ms = t1 - t0;
-    std::cout << "  rendering tile took " << fp_ms.count() << " ms" << std::endl;
+    std::cout << "  rasterizing took " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t1).count() << " ms, " << n_hidden << " of the binned blocks were hidden" << std::endl;
   }
+  debug << n_triangles << " triangles rendered" << std::endl;
   debug.close();
+  resolve(S, shade);
 }
-template void canvas_t<float>::render_scene(const scene<float>& S);
-template void canvas_t<double>::render_scene(const scene<double>& S);
 
-// for each column, walk from top to bottom and colour a pixel dark if it is
-// much closer than the previous one.  Works only because mountains are
-// rarely overhanging or floating in mid-air
+// The resolve pass of render_scene colours the pixels which the geometry pass
+// has drawn, by their distance, and with the shading: the elevation of a pixel
+// follows from its depth and its row, and its slope and the light from the
+// normal.
 template <typename T>
-void canvas_t<T>::highlight_edges() {
+void canvas_t<T>::resolve(const scene<T>& S, const shading& shade) {
   const auto t0 = std::chrono::high_resolution_clock::now();
-  const colour black = {0, 0, 0};
-  const colour dark_gray = {30, 30, 30};
-  const T thr1 = 1.15;
-  const T thr2 = 1.05;
-  for (int64_t x = 0; x < xs(); x++) {
-    T z_prev = std::numeric_limits<T>::max();
-    for (int64_t y = 0; y < ys(); y++) {
-      const T z_curr = zb(x, y);
-      if (z_prev / z_curr > thr1 && z_prev - z_curr > 500) {
-        write_pixel(x, y, black);
+  const T pixels_per_rad_v = ys() / S.view_height; // [px/rad]
+  const T v_offset = S.view_height / 2 + S.view_dir_v;
+  const T sun_az = shade.sun_azimuth * deg2rad_v<T>, sun_el = shade.sun_elevation * deg2rad_v<T>;
+  const std::array<T, 3> sun = {std::sin(sun_az) * std::cos(sun_el), std::cos(sun_az) * std::cos(sun_el), std::sin(sun_el)}; // east, north, up
+  const T rock_slope = shade.rock_slope * deg2rad_v<T>;
+  const colour snow = {255, 255, 255}, rock = {120, 115, 110};
+  const bool plain = !(shade.hillshade > 0 || shade.haze_m > 0 || shade.snow_line_m > 0 || shade.rock_slope > 0);
+#pragma omp parallel for schedule(static)
+  for (int64_t y = 0; y < ys(); y++) {
+    const T tan_angle = std::tan(v_offset - (y + T(0.5)) / pixels_per_rad_v); // of the pixel centre, up is positive
+    for (int64_t x = 0; x < xs(); x++) {
+      const uint32_t surface = surface_[x, y];
+      if (surface == 0)
+        continue;
+      const T d = zb(x, y);
+      const colour base = colour_scheme1(d);
+      if (plain) {
+        wc(x, y) = int32_t(base);
+        continue;
       }
-      else if (z_prev / z_curr > thr2 && z_prev - z_curr > 200) {
-        write_pixel(x, y, dark_gray);
+      T r = base.r_, g = base.g_, b = base.b_;
+      const auto blend = [&](const colour& c, T weight) {
+        r += weight * (c.r_ - r), g += weight * (c.g_ - g), b += weight * (c.b_ - b);
+      };
+      const auto [east, north, up] = decode_normal<T>(surface);
+      if (shade.snow_line_m > 0) {
+        const T elevation = S.z_standpoint_m + d * tan_angle + curvature_drop(d); // [m]
+        blend(snow, std::clamp((elevation - shade.snow_line_m) / 200, T(0), T(1)));
+      }
+      if (shade.rock_slope > 0)
+        blend(rock, std::clamp((std::acos(up) - rock_slope) / T(0.2), T(0), T(1)));
+      if (shade.hillshade > 0) { // Lambert, relative to flat terrain
+        const T light = std::max(east * sun[0] + north * sun[1] + up * sun[2], T(0)) / sun[2];
+        const T factor = 1 - shade.hillshade + shade.hillshade * std::min(light, T(2));
+        r *= factor, g *= factor, b *= factor;
+      }
+      if (shade.haze_m > 0)
+        blend(shade.haze_colour, 1 - std::exp2(-d / shade.haze_m));
+      const auto channel = [](T c) { return uint8_t(std::clamp(c, T(0), T(255))); };
+      wc(x, y) = int32_t(colour(channel(r), channel(g), channel(b)));
+    }
+  }
+  surface_ = array2D<uint32_t>();
+  std::cout << "  resolving the colours took " << std::chrono::duration<double, std::milli>(std::chrono::high_resolution_clock::now() - t0).count() << " ms" << std::endl;
+}
+template void canvas_t<float>::render_scene(const scene<float>& S, rasterization mode, terrain_mesh mesh, const shading& shade, bool record_cells);
+template void canvas_t<double>::render_scene(const scene<double>& S, rasterization mode, terrain_mesh mesh, const shading& shade, bool record_cells);
+
+// colour a pixel dark if it is much closer than the one above it.  Works only
+// because mountains are rarely overhanging or floating in mid-air.  Each
+// pixel depends on the z buffer in its own and the previous row only, hence
+// rows are independent, and each is one sequential pass over both, of which
+// simd::float_v::width pixels are compared at once.  Depths are positive, such
+// that the ratios are compared without divisions.
+template <typename T>
+void canvas_t<T>::highlight_edges(const T major_ratio, const T major_gap_m, const T minor_ratio, const T minor_gap_m) {
+  const auto t0 = std::chrono::high_resolution_clock::now();
+  const int32_t black = int32_t(colour{0, 0, 0});
+  const int32_t dark_gray = int32_t(colour{30, 30, 30});
+  const std::vector<T> nothing(xs(), std::numeric_limits<T>::max()); // above the first row
+#pragma omp parallel for schedule(static)
+  for (int64_t y = 0; y < ys(); y++) {
+    const T* const z_prev = y == 0 ? nothing.data() : &zb()[0, y - 1];
+    const T* const z_curr = &zb()[0, y];
+    int32_t* const row = &wc()[0, y];
+    int64_t x = 0;
+    if constexpr (std::is_same_v<T, float>) {
+      using simd::float_v;
+      for (; x + float_v::width <= xs(); x += float_v::width) {
+        const float_v prev = float_v::load(z_prev + x), curr = float_v::load(z_curr + x);
+        const float_v gap = prev - curr;
+        const uint32_t major = simd::bits(prev > curr * float_v(major_ratio)) & simd::bits(gap > float_v(major_gap_m));
+        const uint32_t minor = simd::bits(prev > curr * float_v(minor_ratio)) & simd::bits(gap > float_v(minor_gap_m));
+        for (uint32_t lanes = major | minor; lanes; lanes &= lanes - 1) {
+          const int i = std::countr_zero(lanes);
+          row[x + i] = (major >> i & 1) ? black : dark_gray;
+        }
       }
-      z_prev = z_curr;
+    }
+    for (; x < xs(); x++) {
+      if (z_prev[x] > z_curr[x] * major_ratio && z_prev[x] - z_curr[x] > major_gap_m)
+        row[x] = black;
+      else if (z_prev[x] > z_curr[x] * minor_ratio && z_prev[x] - z_curr[x] > minor_gap_m)
+        row[x] = dark_gray;
     }
   }
 
@@ -375,8 +865,8 @@ void canvas_t<T>::highlight_edges() {
   std::chrono::duration<double, std::milli> fp_ms = t1 - t0;
   std::cout << "  edge highlighting took " << fp_ms.count() << " ms" << std::endl;
 }
-template void canvas_t<float>::highlight_edges();
-template void canvas_t<double>::highlight_edges();
+template void canvas_t<float>::highlight_edges(float major_ratio, float major_gap_m, float minor_ratio, float minor_gap_m);
+template void canvas_t<double>::highlight_edges(double major_ratio, double major_gap_m, double minor_ratio, double minor_gap_m);
 
 template <typename T>
 void canvas_t<T>::render_test() {
@@ -405,6 +895,7 @@ void canvas<T>::annotate_peaks(const scene<T>& S) {
   const auto t0 = std::chrono::high_resolution_clock::now();
   // read all peaks from all tiles in S
   std::vector<point_feature<T>> peaks;
+  S.wait_for_tiles();
   for (const auto& tile : S.tiles) {
     std::string path("osm");
     std::string xml_name(std::string(tile.first.lat() < 0 ? "S" : "N") + to_stringish_fixedwidth<std::string>(std::abs(tile.first.lat()), 2) +
@@ -452,8 +943,8 @@ bool canvas<T>::peak_is_visible_v1(const scene<T>& S, const point_feature<T>& pe
   const T fractpart_i = std::modf(peak.lat(), &intpart_i);
   const T fractpart_j = std::modf(peak.lon(), &intpart_j);
 
-  const tile<T>& H = S.tiles[tile_index].first;
-  const tile<T>& D = S.tiles[tile_index].second;
+  const tile<int16_t>& H = S.tiles[tile_index].first;
+  const distance_field<T>& D = S.tiles[tile_index].second;
   const auto [xst, yst] = H.size();
 
   // get a few triangles around the peak, we're interested in 25 squares around the peak, between y-rad/x-rad and y+rad/x+rad
@@ -502,16 +993,16 @@ bool canvas<T>::peak_is_visible_v1(const scene<T>& S, const point_feature<T>& pe
         continue;
 
       // std::cout << S.z_standpoint << ", " << H(y,x) << ", " <<  D(y,x) << std::endl;
-      const T v_ij = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x, y], D[x, y])) * pixels_per_rad_v; // [px]
+      const T v_ij = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x, y] - curvature_drop(D[x, y]), D[x, y])) * pixels_per_rad_v; // [px]
       if (!is_in_range(v_ij, 0, ys()))
         continue;
-      const T v_ijj = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x + inc, y], D[x + inc, y])) * pixels_per_rad_v; //[px]
+      const T v_ijj = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x + inc, y] - curvature_drop(D[x + inc, y]), D[x + inc, y])) * pixels_per_rad_v; //[px]
       if (!is_in_range(v_ijj, 0, ys()))
         continue;
-      const T v_iij = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x, y + inc], D[x, y + inc])) * pixels_per_rad_v; // [px]
+      const T v_iij = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x, y + inc] - curvature_drop(D[x, y + inc]), D[x, y + inc])) * pixels_per_rad_v; // [px]
       if (!is_in_range(v_iij, 0, ys()))
         continue;
-      const T v_iijj = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x + inc, y + inc], D[x + inc, y + inc])) * pixels_per_rad_v; // [px]
+      const T v_iijj = (view_height / 2 + view_direction_v - angle_v(S.z_standpoint_m, H[x + inc, y + inc] - curvature_drop(D[x + inc, y + inc]), D[x + inc, y + inc])) * pixels_per_rad_v; // [px]
       if (!is_in_range(v_iijj, 0, ys()))
         continue;
       // debug << "v: " << v_ij << ", " << v_ijj << ", " << v_iij << ", " << v_iijj << std::endl;
@@ -582,14 +1073,11 @@ bool canvas<T>::peak_is_visible_v2(const scene<T>& S, const point_feature<T>& pe
     const T dist_point = dist_peak - seg_length * seg;
     const auto dest_coord = destination(S.standpoint, dist_point, bearing_rad);
 
-    // find tile in which the point lies
-    const int64_t tile_index = get_tile_index(S, dest_coord.to_deg());
-    // std::cout << "point coord: " << point_lat*rad2deg_v<T> << ", " <<  point_lon*rad2deg << std::endl;
-    // std::cout << "tile index: " << tile_index << std::endl;
-    const tile<T>& H = S.tiles[tile_index].first;
-
-    // interpolate to get elevation
-    const T height_point = H.interpolate(dest_coord.to_deg());
+    // interpolate to get elevation, as it appears from the standpoint
+    const std::optional<T> elevation = S.elevation(dest_coord.to_deg());
+    if (!elevation) // no data, eg on the sea
+      break;
+    const T height_point = *elevation - curvature_drop(dist_point);
     // std::cout << "height: " << height_point << std::endl;
     // if uphill, but allow for slightly wrong peak location
     if (height_point > prev_height && seg > 2) {
@@ -630,63 +1118,177 @@ bool canvas<T>::peak_is_visible_v2(const scene<T>& S, const point_feature<T>& pe
 }
 
 
-// test if a peak is visible by attempting to draw a few triangles around it,
-// if the zbuffer admits any pixel to be drawn, the peak is visible
+// test if a peak is visible by looking up which cells of the elevation data
+// are drawn around the pixel of the peak.  If any of them is close to the
+// peak, I call the peak visible, else something in front hides it.  Nothing
+// is drawn, and no elevation data is read.
 template <typename T>
-std::tuple<std::vector<point_feature_on_canvas<T>>, std::vector<point_feature_on_canvas<T>>> canvas<T>::get_visible_peaks(std::vector<point_feature<T>>& peaks, const scene<T>& S) {
-  const T view_direction_h = S.view_dir_h;       // [rad]
-  const T view_width = S.view_width;             // [rad]
-  const T pixels_per_rad_h = xs() / view_width;  // [px/rad]
-  const T view_direction_v = S.view_dir_v;       // [rad]
-  const T view_height = S.view_height;           // [rad]
-  const T pixels_per_rad_v = ys() / view_height; // [px/rad]
+bool canvas<T>::peak_is_visible_v3(const scene<T>& S, const point_feature<T>& peak, const T x_peak, const T y_peak, const T dist_peak) const {
+  const T pixels_per_rad_h = xs() / S.view_width;  // [px/rad]
+  const T pixels_per_rad_v = ys() / S.view_height; // [px/rad]
+  const int64_t radius = 2;                        // [px]
+  // The pixels around the peak show the ground within a few pixels of it,
+  // across the line of sight.  Along it, a row of pixels spans more ground,
+  // on slopes of 15 deg about four times as much.  Either way, add the size
+  // of a cell and a little for slightly wrong peak locations.
+  // Offsets from the peak are small, hence they are taken in the plane, east
+  // and north, and turned to along and across the line of sight.
+  const T bearing_peak = bearing(S.standpoint, peak.coords.to_rad());
+  const T sin_b = std::sin(bearing_peak), cos_b = std::cos(bearing_peak);
+  const T m_per_deg = deg2rad_v<T> * average_radius_earth<T>, m_per_deg_lon = m_per_deg * std::cos(peak.lat() * deg2rad_v<T>);
+  const T across_m = (radius + 1) * dist_peak / pixels_per_rad_h, along_m = 4 * (radius + 1) * dist_peak / pixels_per_rad_v; // [m]
+  const int64_t x0 = std::max<int64_t>(std::floor(x_peak) - radius, 0), x1 = std::min<int64_t>(std::floor(x_peak) + radius + 1, xs());
+  const int64_t y0 = std::max<int64_t>(std::floor(y_peak) - radius, 0), y1 = std::min<int64_t>(std::floor(y_peak) + radius + 1, ys());
+  for (int64_t y = y0; y < y1; y++) {
+    for (int64_t x = x0; x < x1; x++) {
+      const uint32_t id = cells[x, y];
+      if (id == cell_id::none)
+        continue;
+      const auto& H = S.tiles[cell_id::tile(id)].first;
+      const int64_t n = H.xs() - 1;   // cells per side
+      const T cell_m = m_per_deg / n; // [m]
+      // from the peak to the centre of the cell [m]
+      const T east = (H.lon() + (cell_id::index(id) % H.xs() + T(0.5)) / n - peak.lon()) * m_per_deg_lon;
+      const T north = (H.lat() + 1 - (cell_id::index(id) / H.xs() + T(0.5)) / n - peak.lat()) * m_per_deg;
+      const T along = east * sin_b + north * cos_b, across = north * sin_b - east * cos_b;
+      if (std::abs(across) < across_m + 2 * cell_m && std::abs(along) < along_m + 2 * cell_m)
+        return true;
+    }
+  }
+  return false;
+}
+
+
+template <typename T>
+std::optional<std::pair<LatLon<T, Unit::deg>, T>> canvas<T>::pick(const scene<T>& S, const int64_t x, const int64_t y) const {
+  if (x < 0 || x >= cells.xs() || y < 0 || y >= cells.ys() || cells[x, y] == cell_id::none)
+    return std::nullopt;
+  // S may not be the scene that was rendered
+  const int64_t t = cell_id::tile(cells[x, y]);
+  if (t >= std::ssize(S.tiles))
+    return std::nullopt;
+  const auto& H = S.tiles[t].first;
+  const int64_t n = H.xs() - 1; // cells per side
+  const int64_t index = cell_id::index(cells[x, y]);
+  if (n < 1 || index / H.xs() >= n || index % H.xs() >= n)
+    return std::nullopt;
+  const LatLon<T, Unit::deg> centre(H.lat() + 1 - (index / H.xs() + T(0.5)) / n, H.lon() + (index % H.xs() + T(0.5)) / n);
+  return std::pair(centre, T(H.interpolate(centre)));
+}
+template std::optional<std::pair<LatLon<float, Unit::deg>, float>> canvas<float>::pick(const scene<float>& S, int64_t x, int64_t y) const;
+template std::optional<std::pair<LatLon<double, Unit::deg>, double>> canvas<double>::pick(const scene<double>& S, int64_t x, int64_t y) const;
 
-  std::vector<point_feature_on_canvas<T>> visible_peaks;
-  std::vector<point_feature_on_canvas<T>> obscured_peaks;
+
+template <typename T>
+std::optional<std::pair<point_feature_on_canvas<T>, bool>> canvas<T>::place_peak(point_feature<T>& peak, const scene<T>& S) const {
+  const T pixels_per_rad_h = xs() / S.view_width;  // [px/rad]
+  const T pixels_per_rad_v = ys() / S.view_height; // [px/rad]
+  const T pi = std::numbers::pi_v<T>;
+
+  // distance from the peak
+  const T dist_peak = distance_atan(S.standpoint, peak.coords.to_rad());
+  if (dist_peak > S.view_range_m || dist_peak < 1000)
+    return std::nullopt;
+
+  // height of the peak, according to elevation data
+  const std::optional<T> elevation = S.elevation(peak.coords);
+  if (!elevation)
+    return std::nullopt;
+  const T height_peak = *elevation;
+  // if the osm doesn't know the height, take from elevation data
+  if (peak.elev == 0) {
+    peak.elev = height_peak;
+  }
+
+  // get position of peak on canvas, nothing if outside
+  const T x_peak = std::fmod(S.view_dir_h + S.view_width / 2 + bearing(S.standpoint, peak.coords.to_rad()) + T(1.5) * pi, 2 * pi) * pixels_per_rad_h;
+  const T y_peak = (S.view_dir_v + S.view_height / 2 - angle_v(S.z_standpoint_m, height_peak - curvature_drop(dist_peak), dist_peak)) * pixels_per_rad_v; // [px]
+  if (x_peak < 0 || x_peak >= xs())
+    return std::nullopt;
+  if (y_peak < 0 || y_peak >= ys())
+    return std::nullopt;
+
+  // if(peak_is_visible_v1(S, peak, dist_peak, tile_index))
+  // the recorded cells are cheaper to look up than drawing
+  const bool visible = cells.empty() ? peak_is_visible_v2(S, peak, dist_peak) : peak_is_visible_v3(S, peak, x_peak, y_peak, dist_peak);
+  return std::pair(point_feature_on_canvas<T>(peak, x_peak, y_peak, dist_peak), visible);
+}
+template std::optional<std::pair<point_feature_on_canvas<float>, bool>> canvas<float>::place_peak(point_feature<float>& peak, const scene<float>& S) const;
+template std::optional<std::pair<point_feature_on_canvas<double>, bool>> canvas<double>::place_peak(point_feature<double>& peak, const scene<double>& S) const;
+
+
+// Which peaks are on the canvas, and which of those are visible, in two
+// stages.  First, a conservative test of range and sector, for all peaks and
+// simd::float_v::width at a time, in a flat approximation around the
+// standpoint, with slack for the error of the approximation.  Then the exact
+// projection and the visibility test of place_peak for the peaks which pass,
+// in parallel.  The first stage only saves time, the lists are those of
+// place_peak for every peak.  Both lists keep the order of the peaks.
+template <typename T>
+std::tuple<std::vector<point_feature_on_canvas<T>>, std::vector<point_feature_on_canvas<T>>> canvas<T>::get_visible_peaks(std::vector<point_feature<T>>& peaks, const scene<T>& S) {
+  const T view_direction_h = S.view_dir_h; // [rad]
+  const T view_width = S.view_width;       // [rad]
   const T pi = std::numbers::pi_v<T>;
+
+  // east and north [rad] of the standpoint, with the longitude scaled at
+  // the standpoint.  Over the range, the scale of the longitude changes by
+  // about reach * tan(lat) relative, and so do distances, while bearings
+  // are off by about half as much.
+  const auto [lat_s, lon_s] = S.standpoint;
+  const T reach = S.view_range_m / average_radius_earth<T>; // [rad]
+  const T slack = 2 * reach * std::tan(std::min(std::abs(lat_s), T(1.5))) + T(0.01);
+  const T half_width = view_width / 2 + slack;        // [rad]
+  const T bearing_centre = pi / 2 - view_direction_h; // [rad], of the middle of the canvas
+  using simd::float_v;
+  const int64_t n_padded = (std::ssize(peaks) + float_v::width - 1) / float_v::width * float_v::width;
+  std::vector<float> east(n_padded, 1), north(n_padded, 1); // padding is out of range
   for (int64_t p = 0; p < std::ssize(peaks); p++) {
-    // std::cout << "--- p=" << p << " ---" << std::endl;
-    // distance from the peak
-    const T dist_peak = distance_atan(S.standpoint, peaks[p].coords.to_rad());
-    if (dist_peak > S.view_range_m || dist_peak < 1000)
-      continue;
-
-    const int64_t tile_index = get_tile_index<T>(S, peaks[p].coords);
-    if (tile_index == -1) {
-      std::cout << "skip" << std::endl;
-      continue;
-    }
-
-    const tile<T>& H = S.tiles[tile_index].first;
-
-    // height of the peak, according to elevation data
-    const T height_peak = H.interpolate(peaks[p].coords);
-    // std::cout << "peak height and dist: " << height_peak << ", " << dist_peak << std::endl;
-    // if the osm doesn't know the height, take from elevation data
-    const T coeff = 0.065444 / 1000000.0; // = 0.1695 / 1.609^2  // m
-    if (peaks[p].elev == 0) {
-      peaks[p].elev = height_peak + coeff * dist_peak * dist_peak; // revert earth's curvature
-    }
-
-    // get position of peak on canvas, continue if outside
-    const T x_peak = std::fmod(view_direction_h + view_width / 2 + bearing(S.standpoint, peaks[p].coords.to_rad()) + T(1.5) * pi, 2 * pi) * pixels_per_rad_h;
-    const T y_peak = (view_direction_v + view_height / 2 - angle_v(S.z_standpoint_m, height_peak, dist_peak)) * pixels_per_rad_v; // [px]
-    // std::cout << "peak x, y " << x_peak << ", " << y_peak << std::endl;
-    if (x_peak < 0 || x_peak >= xs())
-      continue;
-    if (y_peak < 0 || y_peak >= ys())
-      continue;
-
-    // if(peak_is_visible_v1(S, peaks[p], dist_peak, tile_index))
-    if (peak_is_visible_v2(S, peaks[p], dist_peak)) {
-      visible_peaks.emplace_back(peaks[p], x_peak, y_peak, dist_peak);
+    const auto [lat, lon] = peaks[p].coords.to_rad();
+    east[p] = std::remainder(lon - lon_s, 2 * pi) * std::cos(lat_s);
+    north[p] = lat - lat_s;
+  }
+  const float_v max_sq(std::pow(reach * (1 + slack), 2));
+  const float_v dir_east(std::sin(bearing_centre)), dir_north(std::cos(bearing_centre));
+  const float_v cos_half_width(half_width < pi ? std::cos(half_width) : -2); // nothing is outside of a sector of 2 pi
+  std::vector<int64_t> candidates;
+  for (int64_t p = 0; p < n_padded; p += float_v::width) {
+    const float_v e = float_v::load(&east[p]), n = float_v::load(&north[p]);
+    const float_v sq = simd::fma(e, e, n * n);
+    // angle from the middle of the canvas more than half_width
+    const uint32_t outside = simd::bits(simd::fma(e, dir_east, n * dir_north) < simd::sqrt(sq) * cos_half_width);
+    for (uint32_t bits = simd::bits(sq < max_sq) & ~outside; bits; bits &= bits - 1)
+      candidates.push_back(p + std::countr_zero(bits));
+  }
+
+  // per thread, with their index into peaks
+  std::vector<std::pair<int64_t, point_feature_on_canvas<T>>> visible, obscured;
+  S.wait_for_tiles();
+#pragma omp parallel
+  {
+    std::vector<std::pair<int64_t, point_feature_on_canvas<T>>> visible_t, obscured_t;
+#pragma omp for schedule(dynamic, 16) nowait
+    for (int64_t i = 0; i < std::ssize(candidates); i++) {
+      const int64_t p = candidates[i];
+      if (auto placed = place_peak(peaks[p], S))
+        (placed->second ? visible_t : obscured_t).emplace_back(p, std::move(placed->first));
     }
-    else {
-      obscured_peaks.emplace_back(peaks[p], x_peak, y_peak, dist_peak);
+#pragma omp critical
+    {
+      std::ranges::move(visible_t, std::back_inserter(visible));
+      std::ranges::move(obscured_t, std::back_inserter(obscured));
     }
   }
-  return {visible_peaks, obscured_peaks};
+  const auto in_order = [](std::vector<std::pair<int64_t, point_feature_on_canvas<T>>>& v) {
+    std::ranges::sort(v, {}, [](const auto& pair) { return pair.first; });
+    std::vector<point_feature_on_canvas<T>> res;
+    res.reserve(v.size());
+    std::ranges::move(v | std::views::values, std::back_inserter(res));
+    return res;
+  };
+  return {in_order(visible), in_order(obscured)};
 }
+template std::tuple<std::vector<point_feature_on_canvas<float>>, std::vector<point_feature_on_canvas<float>>> canvas<float>::get_visible_peaks(std::vector<point_feature<float>>& peaks, const scene<float>& S);
+template std::tuple<std::vector<point_feature_on_canvas<double>>, std::vector<point_feature_on_canvas<double>>> canvas<double>::get_visible_peaks(std::vector<point_feature<double>>& peaks, const scene<double>& S);
 
 
 template <typename T>
@@ -782,6 +1384,7 @@ void canvas<T>::draw_coast(const scene<T>& S) {
   //     height(core.get_height());
   // read all peaks from all tiles in S
   std::vector<linear_feature<T>> coasts;
+  S.wait_for_tiles();
   for (const auto& ti : S.tiles) {
     std::string path("osm");
     std::string xml_name(std::string(ti.first.lat() < 0 ? "S" : "N") + to_stringish_fixedwidth<std::string>(std::abs(ti.first.lat()), 2) +
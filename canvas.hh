@@ -2,14 +2,18 @@
 
 #include "array2d.hh"
 #include "colour.hh"
+#include <atomic>
+#include <bit>
 #include <cassert>
 #include <cstdint>
 #include <cstdio>
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <optional>
 #include <string>
 #include <tuple>
+#include <utility>
 #include <vector>
 
 #include <gd.h>
@@ -22,8 +26,22 @@ template <typename T>
 struct point_feature_on_canvas;
 
 
-template <typename T>
-int64_t get_tile_index(const scene<T>& S, LatLon<T, Unit::deg> point);
+// A cell of the elevation data, as render_scene can record it per pixel: the
+// index of the tile in scene::tiles in the upper 8 bits, and the index y * xs
+// + x of the north-west vertex of the cell in the lower 24 bits, which is
+// enough for 3601 x 3601 tiles.
+namespace cell_id {
+constexpr uint32_t none = std::numeric_limits<uint32_t>::max();
+constexpr int64_t max_tiles = 255;                 // tile 255 could make none
+constexpr int64_t max_vertices = int64_t(1) << 24; // per tile
+
+constexpr uint32_t make(int64_t t, int64_t index) {
+  assert(t >= 0 && t < max_tiles && index >= 0 && index < max_vertices);
+  return uint32_t(t) << 24 | uint32_t(index);
+}
+constexpr int64_t tile(uint32_t id) { return id >> 24; }
+constexpr int64_t index(uint32_t id) { return id & 0xffffff; }
+} // namespace cell_id
 
 
 template <typename T>
@@ -46,25 +64,40 @@ public:
   constexpr int32_t a2d(int64_t x, int64_t y) const { return arr2d_[x, y]; }
   constexpr int32_t& a2d(int64_t x, int64_t y) { return arr2d_[x, y]; }
 
-  zbuffered_array operator+(const zbuffered_array& rh) const { return zbuffered_array(*this) += rh; }
-  zbuffered_array& operator+=(const zbuffered_array& rh) {
-    for (int64_t y = 0; y < ys(); y++) {
-      for (int64_t x = 0; x < xs(); x++) {
-        if (rh.zb(x, y) < zbuffer_[x, y]) { // rh is closer
-          arr2d_[x, y] = rh.a2d(x, y);
-          zbuffer_[x, y] = rh.zb(x, y);
-        }
-      }
-    }
-    return *this;
-  }
-
 private:
   array2D<T> zbuffer_;
   array2D<int32_t> arr2d_;
 };
 
 
+// how render_scene distributes the work among threads
+// binned: columns of the canvas are rasterized by one thread each
+// shared_atomic: all threads rasterize into one canvas of packed depth and
+// normal, which they update with atomic compare-and-swap
+enum class rasterization { binned,
+                           shared_atomic };
+
+// what render_scene draws of each block of a tile
+// grid: two triangles per quad of the level of detail of the block
+// adaptive: the coarsest triangulation of that level which deviates less than
+// a pixel from the full tile, as seen from the standpoint
+enum class terrain_mesh { grid,
+                          adaptive };
+
+// How render_scene colours the terrain.  The colour by distance is modified
+// by the following, each of which is off at 0.  They are applied once per
+// pixel, after all of the terrain is drawn.
+struct shading {
+  float hillshade = 0;                  // [0, 1], weight of the light from the sun, against the ambient light
+  float sun_azimuth = 315;              // [deg], clockwise from north
+  float sun_elevation = 45;             // [deg], in ]0, 90] for hillshading
+  float haze_m = 0;                     // [m], distance at which the haze hides half of the terrain
+  colour haze_colour = {180, 190, 210};
+  float snow_line_m = 0;                // [m], the terrain above is white
+  float rock_slope = 0;                 // [deg], steeper terrain is gray
+};
+
+
 template <typename T>
 class canvas_t {
 public:
@@ -87,10 +120,16 @@ public:
   constexpr int32_t wc(int64_t x, int64_t y) const { return buffered_canvas.a2d(x, y); }
   constexpr int32_t& wc(int64_t x, int64_t y) { return buffered_canvas.a2d(x, y); }
 
-  // for each column, walk from top to bottom and colour a pixel dark if it is
-  // much closer than the previous one.  Works only because mountains are
-  // rarely overhanging or floating in mid-air
-  void highlight_edges();
+  // the cell_id per pixel, empty unless render_scene was asked to record them
+  const auto& cells() const& { return cells_; }
+  auto&& cells() && { return std::move(cells_); }
+
+  // colour a pixel dark if it is much closer than the one above it, row by
+  // row.  Works only because mountains are rarely overhanging or floating in
+  // mid-air.  Pixels which are closer by both a factor of major_ratio and
+  // major_gap_m [m] are black, those closer by minor_ratio and minor_gap_m are
+  // dark gray.
+  void highlight_edges(T major_ratio = 1.15, T major_gap_m = 500, T minor_ratio = 1.05, T minor_gap_m = 200);
 
   // just write the pixel taking into account the zbuffer
   void write_pixel_zb(const int64_t x, const int64_t y, const T z, const colour& col) {
@@ -105,17 +144,75 @@ public:
     buffered_canvas.a2d(x, y) = int32_t(col);
   }
 
-  // true if any pixel was drawn
+  // only columns [x_begin, x_end) of the canvas are drawn to
   void draw_triangle(T x1, T y1, T x2, T y2, T x3, T y3, T z,
-                     const colour& col);
-
-  void render_scene(const scene<T>& S);
+                     const colour& col,
+                     int64_t x_begin = 0, int64_t x_end = std::numeric_limits<int64_t>::max());
+  // the triangles 1-2-3 and 2-3-4, which share the edge 2-3, as the two halves
+  // of a quad in a tile
+  void draw_quad(T x1, T y1, T x2, T y2, T x3, T y3, T x4, T y4,
+                 T z1, const colour& col1, T z2, const colour& col2,
+                 int64_t x_begin = 0, int64_t x_end = std::numeric_limits<int64_t>::max());
+
+  // with record_cells, the cell of the elevation data which is drawn is kept
+  // for each pixel, in cells()
+  void render_scene(const scene<T>& S, rasterization mode = rasterization::binned, terrain_mesh mesh = terrain_mesh::adaptive, const shading& shade = {}, bool record_cells = false);
   void render_test();
   void bucket_fill(uint8_t r, uint8_t g, uint8_t b);
 
 private:
+  // the geometry pass of render_scene writes depth and surface only, and the
+  // colours are resolved per pixel once it is done.  The cell is written only
+  // if cells are recorded.
+  void write_surface_zb(const int64_t x, const int64_t y, const T z, const uint32_t surface, const uint32_t cell) {
+    if (!packed_.empty()) { // rasterization::shared_atomic
+      if (packed_cells_.empty())
+        atomic_min(packed_[y * xs() + x], pack(z, surface));
+      else if (packed_[y * xs() + x] == pack(z, surface)) // the second pass, for the cells, see render_scene
+        atomic_min(packed_cells_[y * xs() + x], cell);
+      return;
+    }
+    // ties resolve like the packed words of shared_atomic, to the smaller
+    // surface and then cell, such that both modes draw the same
+    const T z_old = buffered_canvas.zb(x, y);
+    if (z < z_old || (z == z_old && (surface < surface_[x, y] || (surface == surface_[x, y] && !cells_.empty() && cell < cells_[x, y])))) {
+      buffered_canvas.zb(x, y) = z;
+      surface_[x, y] = surface;
+      if (!cells_.empty())
+        cells_[x, y] = cell;
+    }
+  }
+  template <typename U>
+  static void atomic_min(U& word, const U val) {
+    std::atomic_ref<U> p(word);
+    U old = p.load(std::memory_order_relaxed);
+    while (val < old && !p.compare_exchange_weak(old, val, std::memory_order_relaxed)) {
+    }
+  }
+  void resolve(const scene<T>& S, const shading& shade);
+
+  // with a mesh_error [m] of 0 or more, the adaptive mesh of the block is
+  // drawn instead of the quads, if it has one
+  int64_t render_block(const scene<T>& S, int64_t t, int level, int64_t bx, int64_t by, int64_t x_begin, int64_t x_end, T mesh_error);
+
+  // like draw_triangle and draw_quad, but write(x, y) and write(x, y, second)
+  // are called for the covered pixels of the (first or second) triangle
+  template <typename Write>
+  void rasterize_triangle(T x1, T y1, T x2, T y2, T x3, T y3, int64_t x_begin, int64_t x_end, Write&& write) const;
+  template <typename Write>
+  void rasterize_quad(T x1, T y1, T x2, T y2, T x3, T y3, T x4, T y4, int64_t x_begin, int64_t x_end, Write&& write) const;
+
+  // depth as float in the upper half and surface in the lower half, such
+  // that the smaller word is the closer pixel (the bits of positive floats are
+  // ordered like the floats)
+  static uint64_t pack(T z, uint32_t surface) { return uint64_t(std::bit_cast<uint32_t>(float(z))) << 32 | surface; }
+
   int64_t xs_, ys_; // [pixels]
   zbuffered_array<T> buffered_canvas;
+  array2D<uint32_t> surface_;          // only during render_scene, the encoded normal per pixel, 0 where nothing was drawn
+  array2D<uint32_t> cells_;            // cell_id per pixel, if recorded
+  std::vector<uint64_t> packed_;       // only during render_scene with rasterization::shared_atomic
+  std::vector<uint32_t> packed_cells_; // likewise, cell_id, if recorded
 };
 
 
@@ -138,7 +235,7 @@ class canvas {
   };
 
 public:
-  canvas(std::string fn, canvas_t<T> core): xs_(core.xs()), ys_(core.ys()), zbuffer(std::move(core).zb()), filename(std::move(fn)), img_ptr(gdImageCreateTrueColor(xs_, ys_), gdDel_t{}) {
+  canvas(std::string fn, canvas_t<T> core): xs_(core.xs()), ys_(core.ys()), zbuffer(std::move(core).zb()), cells(std::move(core).cells()), filename(std::move(fn)), img_ptr(gdImageCreateTrueColor(xs_, ys_), gdDel_t{}) {
     const array2D<int32_t> wc(std::move(core).wc());
     // allocate mem
     for (int64_t y = 0; y < ys_; y++)
@@ -191,6 +288,19 @@ public:
 
   bool peak_is_visible_v1(const scene<T>& S, const point_feature<T>& peak, T dist_peak, int64_t tile_index) const;
   bool peak_is_visible_v2(const scene<T>& S, const point_feature<T>& peak, T dist_peak) const;
+  // needs the cells recorded by render_scene
+  bool peak_is_visible_v3(const scene<T>& S, const point_feature<T>& peak, T x_peak, T y_peak, T dist_peak) const;
+
+  // the centre of the cell of the elevation data drawn at pixel (x, y), and
+  // its elevation [m], if render_scene has recorded the cells and any terrain
+  // was drawn there.  Nothing for pixels outside of the canvas, or cells which
+  // are not in S.
+  std::optional<std::pair<LatLon<T, Unit::deg>, T>> pick(const scene<T>& S, int64_t x, int64_t y) const;
+
+  // where the peak is on the canvas and whether it is visible, nothing if it
+  // is out of range or off the canvas.  A peak without elevation gets that of
+  // the scene.
+  std::optional<std::pair<point_feature_on_canvas<T>, bool>> place_peak(point_feature<T>& peak, const scene<T>& S) const;
 
   // test if a peak is visible by attempting to draw a few triangles around it,
   // if the zbuffer admits any pixel to be drawn, the peak is visible
@@ -208,6 +318,7 @@ private:
   int64_t xs_;
   int64_t ys_;
   array2D<T> zbuffer;
+  array2D<uint32_t> cells; // cell_id per pixel, empty unless recorded
   std::string filename;
   std::unique_ptr<gdImage, gdDel_t> img_ptr; // which contains: int** tpixels
 };
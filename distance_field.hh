@@ -0,0 +1,116 @@
+#pragma once
+
+#include "array2d.hh"
+#include "geometry.hh"
+#include "latlon.hh"
+#include "tile.hh"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+
+// materialized: one distance per vertex, as returned by tile::get_distances
+// separable: distances are computed when they are accessed, from a few values
+// per row and column, which takes almost no memory
+enum class distance_storage { materialized,
+                              separable };
+
+
+// distances [m] from the standpoint to the vertices of one tile, either one
+// per vertex, or from the haversine_terms of the tile
+template <typename T>
+class distance_field {
+public:
+  using value_type = T;
+
+  distance_field() = default;
+  template <typename U>
+  distance_field(const tile<U>& t, const LatLon<T, Unit::rad> standpoint, const distance_storage storage): xs_(t.xs()), ys_(t.ys()) {
+    if (storage == distance_storage::materialized) {
+      D_ = t.get_distances(standpoint);
+      return;
+    }
+    haversine_terms<T> terms = t.get_haversine_terms(standpoint);
+    R_ = std::move(terms.R);
+    C_ = std::move(terms.C);
+    Q_ = std::move(terms.Q);
+  }
+
+  constexpr int64_t xs() const { return xs_; }
+  constexpr int64_t ys() const { return ys_; }
+  bool is_materialized() const { return R_.empty(); }
+
+  T operator[](int64_t x, int64_t y) const {
+    if (is_materialized())
+      return D_[x, y];
+    return from_haversine(R_[y] + C_[y] * Q_[x]);
+  }
+
+  // every step-th vertex in both directions
+  distance_field subsampled(int64_t step) const {
+    assert((xs_ - 1) % step == 0 && (ys_ - 1) % step == 0);
+    distance_field res;
+    res.xs_ = (xs_ - 1) / step + 1;
+    res.ys_ = (ys_ - 1) / step + 1;
+    if (is_materialized()) {
+      res.D_ = array2D<T>(res.xs_, res.ys_);
+      for (int64_t y = 0; y < res.ys_; y++)
+        for (int64_t x = 0; x < res.xs_; x++)
+          res.D_[x, y] = D_[step * x, step * y];
+      return res;
+    }
+    for (int64_t y = 0; y < ys_; y += step) {
+      res.R_.push_back(R_[y]);
+      res.C_.push_back(C_[y]);
+    }
+    for (int64_t x = 0; x < xs_; x += step)
+      res.Q_.push_back(Q_[x]);
+    return res;
+  }
+
+  // smallest distance of the vertices in [x0, x1] x [y0, y1]
+  T min(int64_t x0, int64_t x1, int64_t y0, int64_t y1) const {
+    T res = std::numeric_limits<T>::max();
+    if (is_materialized()) {
+      for (int64_t y = y0; y <= y1; y++)
+        for (int64_t x = x0; x <= x1; x++)
+          res = std::min(res, D_[x, y]);
+      return res;
+    }
+    // a grows with Q for every row, and d grows with a
+    const T q_min = *std::min_element(Q_.begin() + x0, Q_.begin() + x1 + 1);
+    for (int64_t y = y0; y <= y1; y++)
+      res = std::min(res, from_haversine(R_[y] + C_[y] * q_min));
+    return res;
+  }
+
+  // largest distance of the vertices in [x0, x1] x [y0, y1]
+  T max(int64_t x0, int64_t x1, int64_t y0, int64_t y1) const {
+    T res = 0;
+    if (is_materialized()) {
+      for (int64_t y = y0; y <= y1; y++)
+        for (int64_t x = x0; x <= x1; x++)
+          res = std::max(res, D_[x, y]);
+      return res;
+    }
+    const T q_max = *std::max_element(Q_.begin() + x0, Q_.begin() + x1 + 1);
+    for (int64_t y = y0; y <= y1; y++)
+      res = std::max(res, from_haversine(R_[y] + C_[y] * q_max));
+    return res;
+  }
+
+  // [B]
+  size_t bytes() const { return is_materialized() ? D_.xs() * D_.ys() * sizeof(T) : (R_.size() + C_.size() + Q_.size()) * sizeof(T); }
+
+private:
+  static T from_haversine(T a) { return 2 * average_radius_earth<T> * std::asin(std::sqrt(std::min(a, T(1)))); }
+
+  int64_t xs_ = 0, ys_ = 0;
+  array2D<T> D_;         // materialized
+  std::vector<T> R_, C_; // separable, per row
+  std::vector<T> Q_;     // separable, per column
+};
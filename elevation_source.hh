@@ -0,0 +1,15 @@
+#pragma once
+
+#include <filesystem>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+enum class elevation_source { srtm1,
+                              srtm3,
+                              view1,
+                              view3 };
+inline static std::vector<std::string> elevation_source_name = {"srtm1", "srtm3", "view1", "view3"};
+inline static std::vector<fs::path> elevation_source_folder = {"SRTM1v3.0", "SRTM3v3.0", "VIEW1", "VIEW3"};
+inline static std::vector<int> elevation_source_resolution = {1, 3, 1, 3};
@@ -0,0 +1,44 @@
+// compares the scalar and the simd kernel of tile::get_distances in speed and
+// accuracy, on a tile of 3601 x 3601 vertices next to the standpoint and on
+// one far away
+
+#include <chrono>
+#include <cmath>
+#include <iostream>
+
+#include "../tile.hh"
+
+template <typename F>
+double time_ms(F f, int reps) {
+  const auto t0 = std::chrono::high_resolution_clock::now();
+  for (int i = 0; i < reps; i++)
+    f();
+  const auto t1 = std::chrono::high_resolution_clock::now();
+  return std::chrono::duration<double, std::milli>(t1 - t0).count() / reps;
+}
+
+int main() {
+  const int64_t dim = 3601;
+  const int reps = 5;
+  const LatLon<float, Unit::rad> standpoint = LatLon<float, Unit::deg>(47.05, 10.55).to_rad();
+  std::cout << "simd width: " << simd::float_v::width << std::endl;
+
+  for (const LatLon<int64_t, Unit::deg> coord : {LatLon<int64_t, Unit::deg>(47, 10), LatLon<int64_t, Unit::deg>(49, 13)}) {
+    const tile<int16_t> T(dim, dim, dim, coord);
+    const tile<double> ref = T.get_distances(LatLon<double, Unit::rad>(standpoint), distance_kernel::scalar);
+    tile<float> scalar, vectorised;
+    const double t_scalar = time_ms([&] { scalar = T.get_distances(standpoint, distance_kernel::scalar); }, reps);
+    const double t_simd = time_ms([&] { vectorised = T.get_distances(standpoint, distance_kernel::simd); }, reps);
+
+    double err_scalar = 0, err_simd = 0;
+    for (int64_t y = 0; y < dim; y++) {
+      for (int64_t x = 0; x < dim; x++) {
+        err_scalar = std::max(err_scalar, std::abs(scalar[x, y] - ref[x, y]));
+        err_simd = std::max(err_simd, std::abs(vectorised[x, y] - ref[x, y]));
+      }
+    }
+    std::cout << "tile " << coord << std::endl;
+    std::cout << "  scalar: " << t_scalar << " ms, max error " << err_scalar << " m" << std::endl;
+    std::cout << "  simd:   " << t_simd << " ms, max error " << err_simd << " m" << std::endl;
+  }
+}
@@ -101,6 +101,15 @@ constexpr LatLon<T, Unit::rad> destination(LatLon<T, Unit::rad> point_ref, const
 }
 
 
+// how much lower [m] a point at distance dist [m] appears because of the
+// curvature of the earth, minus refraction.  viewfinder uses
+// drop/m = 0.1695 m * (dist / miles)^2
+template <typename T>
+constexpr T curvature_drop(const T dist /* [m] */) {
+  const T coeff = 0.065444 / 1000000.0; // = 0.1695 / 1.609^2  // m
+  return coeff * dist * dist;           // [m]
+}
+
 // vertical angle between two points, using distance and elevation difference
 // positive is up, negative is down
 template <typename T>
@@ -1,7 +1,11 @@
 #include "canvas.hh"
 #include "latlon.hh"
 #include "scene.hh"
+#include "tile_archive.hh"
+#include "tile_cache.hh"
+#include <optional>
 #include <string>
+#include <tuple>
 #include <vector>
 
 #include <pybind11/pybind11.h>
@@ -25,10 +29,52 @@ PYBIND11_MODULE(libartpano, m) {
       .value("view1", elevation_source::view1)
       .value("view3", elevation_source::view3);
 
+  py::enum_<tile_loading>(m, "tile_loading")
+      .value("eager", tile_loading::eager)
+      .value("pipelined", tile_loading::pipelined);
+  py::enum_<distance_storage>(m, "distance_storage")
+      .value("materialized", distance_storage::materialized)
+      .value("separable", distance_storage::separable);
+  py::enum_<rasterization>(m, "rasterization")
+      .value("binned", rasterization::binned)
+      .value("shared_atomic", rasterization::shared_atomic);
+  py::enum_<terrain_mesh>(m, "terrain_mesh")
+      .value("grid", terrain_mesh::grid)
+      .value("adaptive", terrain_mesh::adaptive);
+  py::class_<shading>(m, "shading")
+      .def(py::init<>())
+      .def_readwrite("hillshade", &shading::hillshade)         // [0, 1]
+      .def_readwrite("sun_azimuth", &shading::sun_azimuth)     // [deg]
+      .def_readwrite("sun_elevation", &shading::sun_elevation) // [deg]
+      .def_readwrite("haze_m", &shading::haze_m)
+      .def_property(
+          "haze_colour", [](const shading& s) { return std::tuple(s.haze_colour.r_, s.haze_colour.g_, s.haze_colour.b_); },
+          [](shading& s, std::tuple<uint8_t, uint8_t, uint8_t> c) { s.haze_colour = colour(std::get<0>(c), std::get<1>(c), std::get<2>(c)); }) // (r, g, b)
+      .def_readwrite("snow_line_m", &shading::snow_line_m)
+      .def_readwrite("rock_slope", &shading::rock_slope); // [deg]
+
+  // the process wide cache of elevation tiles, shared by all scenes
+  py::class_<tile_cache::statistics>(m, "tile_cache_statistics")
+      .def_readonly("hits", &tile_cache::statistics::hits)
+      .def_readonly("misses", &tile_cache::statistics::misses)
+      .def_readonly("evictions", &tile_cache::statistics::evictions)
+      .def_readonly("tiles", &tile_cache::statistics::tiles)
+      .def_readonly("bytes", &tile_cache::statistics::bytes);
+  py::class_<tile_cache, std::unique_ptr<tile_cache, py::nodelete>>(m, "tile_cache")
+      .def_static("instance", &tile_cache::instance, py::return_value_policy::reference)
+      .def("set_budget", &tile_cache::set_budget) // bytes
+      .def("budget", &tile_cache::budget)
+      .def("stats", &tile_cache::stats)
+      .def("clear", &tile_cache::clear);
+
+  m.def("add_tile_archive", [](const std::string& fn) { tile_archive::add(fn); });
+
   // class scene
   using scene_type = scene<float>;
   py::class_<scene_type>(m, "scene")
-      .def(py::init<LatLon<float, Unit::rad>, float, float, float, float, float, float, std::vector<elevation_source>>())
+      .def(py::init<LatLon<float, Unit::rad>, float, float, float, float, float, float, std::vector<elevation_source>, tile_loading, distance_storage>(),
+           py::arg("standpoint"), py::arg("z"), py::arg("view_dir_h"), py::arg("view_width"), py::arg("view_dir_v"), py::arg("view_height"), py::arg("view_range"), py::arg("sources"), py::arg("loading") = tile_loading::eager, py::arg("distances") = distance_storage::materialized)
+      .def("wait_for_tiles", &scene_type::wait_for_tiles, py::call_guard<py::gil_scoped_release>())
       .def_static("determine_required_tiles", &scene_type::determine_required_tiles_v); // double, double, double, latlon
 
   // class canvas_t
@@ -36,8 +82,8 @@ PYBIND11_MODULE(libartpano, m) {
   py::class_<canvas_t_type>(m, "canvas_t")
       .def(py::init<int, int>())
       .def("bucket_fill", &canvas_t_type::bucket_fill)   // int8, int8, int8
-      .def("render_scene", &canvas_t_type::render_scene) // scene
-      .def("highlight_edges", &canvas_t_type::highlight_edges);
+      .def("render_scene", &canvas_t_type::render_scene, py::arg("scene"), py::arg("mode") = rasterization::binned, py::arg("mesh") = terrain_mesh::adaptive, py::arg("shade") = shading{}, py::arg("record_cells") = false)
+      .def("highlight_edges", &canvas_t_type::highlight_edges, py::arg("major_ratio") = 1.15f, py::arg("major_gap") = 500.0f, py::arg("minor_ratio") = 1.05f, py::arg("minor_gap") = 200.0f);
 
   // class canvas
   using canvas_type = canvas<float>;
@@ -47,5 +93,12 @@ PYBIND11_MODULE(libartpano, m) {
       .def("annotate_peaks", &canvas_type::annotate_peaks)     // scene
       .def("annotate_islands", &canvas_type::annotate_islands) // scene
       .def("label_axis", &canvas_type::label_axis)             // scene
+      .def("pick", [](const canvas_type& C, const scene_type& S, int64_t x, int64_t y) -> std::optional<std::tuple<float, float, float>> {
+        const auto picked = C.pick(S, x, y);
+        if (!picked)
+          return std::nullopt;
+        const auto [lat, lon] = picked->first;
+        return std::tuple(lat, lon, picked->second); // [deg], [deg], [m]
+      })
       .def("write_png", &canvas_type::write_png);
 }
@@ -0,0 +1,145 @@
+#pragma once
+
+#include "array2d.hh"
+#include "distance_field.hh"
+#include "geometry.hh"
+#include "tile.hh"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <limits>
+#include <utility>
+#include <vector>
+
+// Coarser versions of one tile, for distant terrain where many quads of the
+// full tile end up in the same pixel.  Level l keeps every 2^l-th vertex of the
+// tile, such that all levels share the vertices on the tile boundary.  Each
+// height is the maximum over the vertices of level l-1 it replaces, hence
+// ridges never sink and the silhouette is kept.  Distances are sampled as they
+// are, they are smooth anyway.
+//
+// The tile is cut into blocks of block_cells x block_cells quads.  For each
+// block, the smallest distance to the standpoint and, for each level, the
+// largest height difference [m] between the level and the full tile are
+// stored, including the vertices on the border of the block, which it shares
+// with its neighbours.  Together with the resolution of the canvas they
+// determine which level is good enough for a block.  The range of distances and heights of
+// each block bound where it can end up in the view, before anything is
+// projected.
+template <typename T>
+class lod_pyramid {
+public:
+  static constexpr int64_t block_cells = 64; // [quads of level 0]
+  static constexpr int max_levels = 4;
+  static constexpr T max_quad_px = 4; // [px], see choose_level
+
+  lod_pyramid() = default;
+  lod_pyramid(const tile<int16_t>& H, const distance_field<T>& D) {
+    assert(H.xs() == D.xs() && H.ys() == D.ys());
+    const int64_t cells = H.xs() - 1;
+    const int64_t n_blocks = (cells + block_cells - 1) / block_cells;
+    cell_m_ = deg2rad_v<T> * average_radius_earth<T> / cells;
+
+    min_dist_ = array2D<T>(n_blocks, n_blocks);
+    max_dist_ = array2D<T>(n_blocks, n_blocks);
+    min_height_ = array2D<int16_t>(n_blocks, n_blocks);
+    max_height_ = array2D<int16_t>(n_blocks, n_blocks);
+    // a vertex of level l is the maximum of up to 2^l - 1 vertices around it,
+    // which may belong to the neighbouring blocks
+    const int64_t reach = (int64_t(1) << max_levels) - 1;
+    for (int64_t by = 0; by < n_blocks; by++) {
+      for (int64_t bx = 0; bx < n_blocks; bx++) {
+        const int64_t x0 = bx * block_cells, x1 = std::min((bx + 1) * block_cells, cells);
+        const int64_t y0 = by * block_cells, y1 = std::min((by + 1) * block_cells, cells);
+        min_dist_[bx, by] = D.min(x0, x1, y0, y1);
+        max_dist_[bx, by] = D.max(x0, x1, y0, y1);
+        int16_t h_min = std::numeric_limits<int16_t>::max(), h_max = std::numeric_limits<int16_t>::lowest();
+        for (int64_t y = y0; y <= y1; y++)
+          for (int64_t x = x0; x <= x1; x++)
+            h_min = std::min(h_min, H[x, y]);
+        for (int64_t y = std::max(y0 - reach, int64_t(0)); y <= std::min(y1 + reach, cells); y++)
+          for (int64_t x = std::max(x0 - reach, int64_t(0)); x <= std::min(x1 + reach, cells); x++)
+            h_max = std::max(h_max, H[x, y]);
+        min_height_[bx, by] = h_min;
+        max_height_[bx, by] = h_max;
+      }
+    }
+
+    // blocks have to be cut into whole quads on every level
+    for (int l = 1; l <= max_levels && cells % (int64_t(1) << l) == 0 && block_cells % (int64_t(1) << l) == 0; l++) {
+      const tile<int16_t>& H_fine = l == 1 ? H : levels_.back().heights;
+      const int64_t n = (H_fine.xs() - 1) / 2 + 1;
+      tile<int16_t> H_coarse(n, n, H.dim(), H.coord());
+      for (int64_t y = 0; y < n; y++) {
+        for (int64_t x = 0; x < n; x++) {
+          int16_t h_max = std::numeric_limits<int16_t>::lowest();
+          for (int64_t yy = std::max<int64_t>(2 * y - 1, 0); yy <= std::min(2 * y + 1, H_fine.ys() - 1); yy++)
+            for (int64_t xx = std::max<int64_t>(2 * x - 1, 0); xx <= std::min(2 * x + 1, H_fine.xs() - 1); xx++)
+              h_max = std::max(h_max, H_fine[xx, yy]);
+          H_coarse[x, y] = h_max;
+        }
+      }
+
+      // compare every vertex of the full tile to the triangles of this level
+      // which cover it, split like in canvas_t::render_scene
+      const int64_t step = int64_t(1) << l;
+      array2D<T> error(n_blocks, n_blocks, 0);
+      for (int64_t y = 0; y < H.ys(); y++) {
+        const int64_t yl = std::min(y >> l, n - 2);
+        const T v = T(y - (yl << l)) / step;
+        for (int64_t x = 0; x < H.xs(); x++) {
+          const int64_t xl = std::min(x >> l, n - 2);
+          const T u = T(x - (xl << l)) / step;
+          const T h = u + v <= 1 ? H_coarse[xl, yl] + u * (H_coarse[xl + 1, yl] - H_coarse[xl, yl]) + v * (H_coarse[xl, yl + 1] - H_coarse[xl, yl])
+                                 : H_coarse[xl + 1, yl + 1] + (1 - u) * (H_coarse[xl, yl + 1] - H_coarse[xl + 1, yl + 1]) + (1 - v) * (H_coarse[xl + 1, yl] - H_coarse[xl + 1, yl + 1]);
+          // vertices on the border between blocks count for both
+          for (int64_t by = std::max<int64_t>(y - 1, 0) / block_cells; by <= std::min(y / block_cells, n_blocks - 1); by++)
+            for (int64_t bx = std::max<int64_t>(x - 1, 0) / block_cells; bx <= std::min(x / block_cells, n_blocks - 1); bx++)
+              error[bx, by] = std::max(error[bx, by], std::abs(h - H[x, y]));
+        }
+      }
+      levels_.push_back({std::move(H_coarse), D.subsampled(step), std::move(error)});
+    }
+  }
+
+  // number of levels beyond the tile itself
+  int levels() const { return std::ssize(levels_); }
+  // level l >= 1
+  const tile<int16_t>& heights(int l) const { return levels_[l - 1].heights; }
+  const distance_field<T>& distances(int l) const { return levels_[l - 1].distances; }
+
+  int64_t blocks() const { return min_dist_.xs(); }
+  // smallest distance [m] of any vertex in block (bx, by)
+  T min_distance(int64_t bx, int64_t by) const { return min_dist_[bx, by]; }
+  // largest distance [m] of any vertex in block (bx, by)
+  T max_distance(int64_t bx, int64_t by) const { return max_dist_[bx, by]; }
+  // range of heights [m] of the vertices in block (bx, by), on any level
+  int16_t min_height(int64_t bx, int64_t by) const { return min_height_[bx, by]; }
+  int16_t max_height(int64_t bx, int64_t by) const { return max_height_[bx, by]; }
+  // largest height difference [m] between level l and the full tile in block (bx, by), and on its border
+  T error(int l, int64_t bx, int64_t by) const { return l == 0 ? 0 : levels_[l - 1].error[bx, by]; }
+
+  // Coarsest level whose error, seen from the closest point of the block,
+  // stays below max_error_px, and whose quads, seen face on from there, are at
+  // most max_quad_px wide.  A small error bounds the height, but not the size
+  // of the flat faces, which show in the hillshading and the cells of pick.
+  int choose_level(int64_t bx, int64_t by, T pixels_per_rad, T max_error_px) const {
+    const T d = min_distance(bx, by);
+    int l = 0;
+    while (l < levels() && error(l + 1, bx, by) / d * pixels_per_rad <= max_error_px && T(int64_t(1) << (l + 1)) * cell_m_ / d * pixels_per_rad <= max_quad_px)
+      l++;
+    return l;
+  }
+
+private:
+  struct level {
+    tile<int16_t> heights;
+    distance_field<T> distances;
+    array2D<T> error; // [m], per block
+  };
+  std::vector<level> levels_;
+  T cell_m_ = 0; // [m], spacing of the vertices of the tile along meridians, and at most along parallels
+  array2D<T> min_dist_, max_dist_;
+  array2D<int16_t> min_height_, max_height_;
+};
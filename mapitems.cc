@@ -6,6 +6,7 @@
 #include <iomanip>
 #include <iostream>
 #include <limits>
+#include <optional>
 #include <string>
 #include <unordered_map>
 #include <vector>
@@ -22,26 +23,26 @@ linear_feature_on_canvas<T>::linear_feature_on_canvas(const linear_feature<T>& _
   const T pixels_per_rad_h = C.xs() / view_width;
   const T pixels_per_rad_v = C.ys() / view_height; // [px/rad]
   const T pi = std::numbers::pi_v<T>;
+  S.wait_for_tiles();
 
   // iterate over points in linear feature
   for (const auto& point_d : lf.coords) {
     const auto point_r = point_d.to_rad();
-    const int64_t tile_index = get_tile_index<T>(S, point_d);
-    if (tile_index < 0) {
+    const std::optional<T> elevation = S.elevation(point_d);
+    if (!elevation) {
       xs.push_back(-1);
       ys.push_back(-1);
       dists.push_back(std::numeric_limits<T>::max());
       std::cout << "nope" << std::endl;
       continue;
     }
-    const tile<T>& H = S.tiles[tile_index].first;
     std::cout << "H " << std::flush;
-    const T z = H.interpolate(point_d);
-    std::cout << " z: " << z << std::flush;
     // get position on canvas, continue if outside
     // std::cout << "lat/lon: " << lat_ref<<", "<< lon_ref<<", "<< lat_r << ", " << lon_r << std::endl;
     const T dist = distance_atan<T>(S.standpoint, point_r);
     std::cout << " dist: " << dist << std::flush;
+    const T z = *elevation - curvature_drop(dist);
+    std::cout << " z: " << z << std::flush;
     const T x = std::fmod(view_dir_h + view_width / 2 + bearing(S.standpoint, point_r) + T(1.5) * pi, 2 * pi) * pixels_per_rad_h;
     std::cout << " x: " << x << std::flush;
     const T y = (view_height / 2 + view_dir_v - angle_v(z_ref, z, dist)) * pixels_per_rad_v; // [px]
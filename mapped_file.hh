@@ -0,0 +1,69 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <filesystem>
+#include <stdexcept>
+#include <string>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace fs = std::filesystem;
+
+// a whole file mapped into memory, unmapped again on destruction.  The mapping
+// is read only, as views of it may be shared by several tiles, and a write
+// faults instead of silently changing the data for all of them.
+class mapped_file {
+public:
+  explicit mapped_file(const fs::path& fn) {
+    const int fd = ::open(fn.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+      throw std::runtime_error("could not open " + fn.string());
+    struct stat st{};
+    if (::fstat(fd, &st) != 0) {
+      ::close(fd);
+      throw std::runtime_error("could not stat " + fn.string());
+    }
+    size_ = st.st_size;
+    if (size_ > 0) {
+      void* addr = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+      if (addr == MAP_FAILED) {
+        ::close(fd);
+        throw std::runtime_error("could not map " + fn.string());
+      }
+      addr_ = static_cast<std::byte*>(addr);
+    }
+    ::close(fd); // the mapping stays valid
+  }
+
+  mapped_file(const mapped_file&) = delete;
+  mapped_file& operator=(const mapped_file&) = delete;
+
+  ~mapped_file() {
+    if (addr_)
+      ::munmap(addr_, size_);
+  }
+
+  constexpr std::byte* data() const noexcept { return addr_; }
+  constexpr size_t size() const noexcept { return size_; }
+
+  // pointer to the element at byte offset 'offset', no bounds checks
+  template <typename U>
+  U* as(size_t offset = 0) const noexcept { return reinterpret_cast<U*>(addr_ + offset); }
+
+  // tell the kernel how we are going to access [offset, offset+length[, eg MADV_SEQUENTIAL or MADV_WILLNEED
+  void advise(int advice, size_t offset = 0, size_t length = 0) const noexcept {
+    if (!addr_)
+      return;
+    const size_t page = ::sysconf(_SC_PAGESIZE);
+    const size_t begin = offset / page * page; // madvise wants page aligned addresses
+    ::madvise(addr_ + begin, (length ? length + offset - begin : size_ - begin), advice);
+  }
+
+private:
+  std::byte* addr_ = nullptr;
+  size_t size_ = 0;
+};
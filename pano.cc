@@ -1,6 +1,10 @@
 #include "canvas.hh"
 #include "geometry.hh"
 #include "scene.hh"
+#include "tile_archive.hh"
+#include "tile_cache.hh"
+#include <cstdint>
+#include <iostream>
 #include <string>
 #include <vector>
 
@@ -11,6 +15,7 @@ namespace po = boost::program_options;
 int main(int ac, char** av) {
   const float lat(47.64829), lon(10.57081), elevation(-1), view_direction_h(270), view_width(120), view_height(40), view_direction_v(0), range_km(20);
   const int canvas_width(10000), canvas_height(1500);
+  const int tile_cache_mib(tile_cache::default_budget >> 20);
 
   po::options_description desc("options");
   // clang-format off
@@ -24,7 +29,18 @@ int main(int ac, char** av) {
                     ("view-height", po::value<float>()->default_value(view_height), "vertical view extent [deg]")
                     ("canvas-width", po::value<int>()->default_value(canvas_width), "horizontal canvas size [pixels]")
                     ("canvas-height", po::value<int>()->default_value(canvas_height), "vertical canvas size [pixels]")
-                    ("range", po::value<float>()->default_value(range_km), "range [km]");
+                    ("range", po::value<float>()->default_value(range_km), "range [km]")
+                    ("tile-cache", po::value<int>()->default_value(tile_cache_mib), "memory budget of the elevation tile cache [MiB]")
+                    ("archive", po::value<std::vector<std::string>>()->composing(), "tile archive(s) to take elevation data from, before looking for .hgt files")
+                    ("pipeline", po::value<bool>()->default_value(true), "read elevation tiles in the background while projecting the terrain (and rasterizing, with --shared-canvas)")
+                    ("separable-distances", po::value<bool>()->default_value(false), "compute distances when they are needed instead of storing one per vertex (less memory)")
+                    ("shared-canvas", po::value<bool>()->default_value(false), "let all threads rasterize into one canvas with atomic updates instead of into columns of their own")
+                    ("adaptive-mesh", po::value<bool>()->default_value(true), "draw as few triangles per block as keep the terrain within a pixel instead of two per quad")
+                    ("hillshade", po::value<float>()->default_value(0), "weight of the light from the sun in the colours, 0 to 1")
+                    ("haze", po::value<float>()->default_value(0), "distance at which haze hides half of the terrain, 0 for none [km]")
+                    ("snow-line", po::value<float>()->default_value(0), "elevation above which the terrain is white, 0 for none [m]")
+                    ("rock-slope", po::value<float>()->default_value(0), "slope above which the terrain is gray, 0 for none [deg]")
+                    ("record-cells", po::value<bool>()->default_value(true), "keep the elevation cell drawn in each pixel, such that peaks are labelled by looking them up instead of by drawing");
   // clang-format on
 
   po::variables_map vm;
@@ -36,6 +52,17 @@ int main(int ac, char** av) {
     return 1;
   }
 
+  const int64_t tile_cache_budget = vm["tile-cache"].as<int>(); // [MiB]
+  if (tile_cache_budget < 0) {
+    std::cerr << "the tile cache budget must not be negative" << std::endl;
+    return 1;
+  }
+  tile_cache::instance().set_budget(size_t(tile_cache_budget) << 20);
+  if (vm.count("archive")) {
+    for (const auto& fn : vm["archive"].as<std::vector<std::string>>())
+      tile_archive::add(fn);
+  }
+
   const std::vector<elevation_source> sources_to_consider({elevation_source::view1, elevation_source::srtm1, elevation_source::view3, elevation_source::srtm3});
 
   scene<float> S({deg2rad_v<float> * vm["lat"].as<float>(),
@@ -46,13 +73,21 @@ int main(int ac, char** av) {
                  deg2rad_v<float> * vm["view-dir-v"].as<float>(),
                  deg2rad_v<float> * vm["view-height"].as<float>(),
                  1000 * vm["range"].as<float>(),
-                 sources_to_consider);
+                 sources_to_consider,
+                 vm["pipeline"].as<bool>() ? tile_loading::pipelined : tile_loading::eager,
+                 vm["separable-distances"].as<bool>() ? distance_storage::separable : distance_storage::materialized);
 
   const std::string filename = "out.png";
 
   canvas_t<float> V(vm["canvas-width"].as<int>(), vm["canvas-height"].as<int>());
   V.bucket_fill(100, 100, 100);
-  V.render_scene(S);
+  const rasterization mode = vm["shared-canvas"].as<bool>() ? rasterization::shared_atomic : rasterization::binned;
+  shading shade;
+  shade.hillshade = vm["hillshade"].as<float>();
+  shade.haze_m = 1000 * vm["haze"].as<float>();
+  shade.snow_line_m = vm["snow-line"].as<float>();
+  shade.rock_slope = vm["rock-slope"].as<float>();
+  V.render_scene(S, mode, vm["adaptive-mesh"].as<bool>() ? terrain_mesh::adaptive : terrain_mesh::grid, shade, vm["record-cells"].as<bool>());
   V.highlight_edges();
 
   canvas<float> VV(filename, std::move(V));
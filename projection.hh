@@ -0,0 +1,183 @@
+#pragma once
+
+#include "array2d.hh"
+#include "distance_field.hh"
+#include "geometry.hh"
+#include "latlon.hh"
+#include "lod_pyramid.hh"
+#include "rtin.hh"
+#include "tile.hh"
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class scene;
+
+
+// Where the vertices of one tile, and of its coarser levels, end up in the
+// view: the horizontal angle [rad] from the left edge and the vertical angle
+// [rad] from the top edge.  Neither depends on the canvas, a canvas only
+// scales them by its resolution, hence they are computed once and shared by
+// every rendering of the scene.
+//
+// The trigonometry is done per block of the lod_pyramid, when the block is
+// first needed at some level, such that blocks which are too far or never
+// rendered at that level cost nothing.  Blocks keep their own copy of the
+// vertices on their boundary, hence no two blocks write the same memory.
+// Blocks outside of the view are recognised from a few corners and the ranges
+// of distance and height, before any vertex is projected.
+//
+// The adaptive triangulation of a block does not depend on the view, but it is
+// built on the first request as well, for the blocks and levels which are
+// rendered.  It is built from the block alone, hence the triangulations of
+// neighbouring blocks need not meet along their common border.
+template <typename T>
+class tile_projection {
+public:
+  // angles of the vertices of one block at one level
+  struct block_angles {
+    int64_t x0 = 0, y0 = 0; // first vertex, in the coordinates of the level
+    array2D<T> h, v;        // [rad], from the left/top edge of the view
+    T h_min, h_max;         // [rad], bounds of h
+    T v_min, v_max;         // [rad], bounds of v
+
+    T h_at(int64_t x, int64_t y) const { return h[x - x0, y - y0]; }
+    T v_at(int64_t x, int64_t y) const { return v[x - x0, y - y0]; }
+  };
+
+  // conservative bounds of the angles of a block on any level
+  struct block_bounds {
+    T h_min, h_max; // [rad], from the left edge of the view
+    T v_min, v_max; // [rad], from the top edge of the view
+  };
+
+  tile_projection() = default;
+  tile_projection(const tile<int16_t>& H, const distance_field<T>& D, const lod_pyramid<T>& lod): H_(&H), D_(&D), lod_(&lod),
+                                                                                                 stride_(lod.blocks() * lod.blocks()),
+                                                                                                 blocks_((lod.levels() + 1) * stride_),
+                                                                                                 once_(std::make_unique<std::once_flag[]>(blocks_.size())),
+                                                                                                 meshes_(blocks_.size()),
+                                                                                                 mesh_once_(std::make_unique<std::once_flag[]>(blocks_.size())) {}
+
+  // projects the block when this is the first request for it.  Several
+  // threads may ask for different or the same blocks.
+  const block_angles& block(const scene<T>& S, int l, int64_t bx, int64_t by) const {
+    const int64_t index = l * stride_ + by * lod_->blocks() + bx;
+    std::call_once(once_[index], [&] { blocks_[index] = project(S, l, bx, by); });
+    return blocks_[index];
+  }
+
+  // the triangulation of the heights of a block at level l, in the
+  // coordinates of the block.  Only blocks of block_cells x block_cells quads
+  // have one, with 2^k cells per side on every level.
+  const rtin<T>& mesh(int l, int64_t bx, int64_t by) const {
+    const int64_t index = l * stride_ + by * lod_->blocks() + bx;
+    std::call_once(mesh_once_[index], [&] {
+      const int64_t block_cells = lod_pyramid<T>::block_cells;
+      assert((bx + 1) * block_cells < H_->xs() && (by + 1) * block_cells < H_->ys());
+      const tile<int16_t>& HL = l == 0 ? *H_ : lod_->heights(l);
+      const int64_t x0 = (bx * block_cells) >> l, y0 = (by * block_cells) >> l;
+      meshes_[index] = rtin<T>(block_cells >> l, [&](int64_t x, int64_t y) { return HL[x0 + x, y0 + y]; });
+    });
+    return meshes_[index];
+  }
+
+  // Bearings to the corners and edge midpoints of the block enclose the
+  // bearings to all of its vertices, unless the standpoint is about as close as
+  // the block is large.  Then the block may surround the standpoint, and
+  // nothing is assumed.  Vertical angles are bounded by the lowest point at
+  // its farthest and the highest point at its closest.
+  block_bounds bounds(const scene<T>& S, int64_t bx, int64_t by) const {
+    const T pi = std::numbers::pi_v<T>;
+    const T invis_angle = std::max(2 * pi - S.view_width, T(0));
+    const T h_offset = S.view_dir_h + S.view_width / 2 + T(1.5) * pi + invis_angle / 2;
+    const T v_offset = S.view_height / 2 + S.view_dir_v;
+    const int64_t cells = H_->xs() - 1;
+    const int64_t block_cells = lod_pyramid<T>::block_cells;
+    const int64_t x0 = bx * block_cells, x1 = std::min((bx + 1) * block_cells, cells);
+    const int64_t y0 = by * block_cells, y1 = std::min((by + 1) * block_cells, cells);
+    const T d_min = lod_->min_distance(bx, by), d_max = lod_->max_distance(bx, by); // [m]
+
+    block_bounds res{-invis_angle / 2, 2 * pi - invis_angle / 2, 0, 0};
+    const T size = std::hypot(T(x1 - x0), T(y1 - y0)) / cells * deg2rad_v<T> * average_radius_earth<T>; // [m], at most
+    if (d_min > size) {
+      const auto bearing_at = [&](int64_t x, int64_t y) {
+        const LatLon<T, Unit::deg> target(H_->lat() + 1 - y / T(cells), H_->lon() + x / T(cells));
+        return bearing(S.standpoint, target.to_rad());
+      };
+      const T b0 = bearing_at(x0, y0);
+      T b_min = 0, b_max = 0; // relative to b0
+      for (const auto& [x, y] : {std::pair{x1, y0}, {x0, y1}, {x1, y1}, {(x0 + x1) / 2, y0}, {(x0 + x1) / 2, y1}, {x0, (y0 + y1) / 2}, {x1, (y0 + y1) / 2}}) {
+        const T db = std::remainder(bearing_at(x, y) - b0, 2 * pi);
+        b_min = std::min(b_min, db), b_max = std::max(b_max, db);
+      }
+      const T margin = 1e-3; // [rad], for the edges along parallels, which are not great circles
+      const T h_lo = h_offset + b0 + b_min - margin, h_hi = h_offset + b0 + b_max + margin;
+      const T wraps = std::floor(h_lo / (2 * pi));
+      if (wraps == std::floor(h_hi / (2 * pi))) { // else the block straddles the back of the view
+        res.h_min = h_lo - wraps * 2 * pi - invis_angle / 2;
+        res.h_max = h_hi - wraps * 2 * pi - invis_angle / 2;
+      }
+    }
+
+    const T z = S.z_standpoint_m;
+    const T top = lod_->max_height(bx, by) - curvature_drop(d_min) - z, bottom = lod_->min_height(bx, by) - curvature_drop(d_max) - z; // [m]
+    res.v_min = v_offset - std::max(std::atan2(top, d_min), std::atan2(top, d_max));
+    res.v_max = v_offset - std::min(std::atan2(bottom, d_min), std::atan2(bottom, d_max));
+    return res;
+  }
+
+private:
+  block_angles project(const scene<T>& S, int l, int64_t bx, int64_t by) const {
+    const tile<int16_t>& HL = l == 0 ? *H_ : lod_->heights(l);
+    const distance_field<T>& DL = l == 0 ? *D_ : lod_->distances(l);
+    const int64_t cells = H_->xs() - 1;
+    const int64_t block_cells = lod_pyramid<T>::block_cells;
+
+    block_angles res;
+    res.x0 = (bx * block_cells) >> l;
+    res.y0 = (by * block_cells) >> l;
+    const int64_t x1 = std::min((bx + 1) * block_cells, cells) >> l;
+    const int64_t y1 = std::min((by + 1) * block_cells, cells) >> l;
+    res.h = array2D<T>(x1 - res.x0 + 1, y1 - res.y0 + 1);
+    res.v = array2D<T>(x1 - res.x0 + 1, y1 - res.y0 + 1);
+
+    const T pi = std::numbers::pi_v<T>;
+    // angles outside of the view wrap to just left of it, such that triangles
+    // which straddle its left edge are still drawn
+    const T invis_angle = std::max(2 * pi - S.view_width, T(0));
+    const T h_offset = S.view_dir_h + S.view_width / 2 + T(1.5) * pi + invis_angle / 2;
+    const T v_offset = S.view_height / 2 + S.view_dir_v;
+    const int64_t n = HL.xs() - 1; // cells of the level
+    for (int64_t y = res.y0; y <= y1; y++) {
+      const T lat = H_->lat() + 1 - y / T(n);
+      for (int64_t x = res.x0; x <= x1; x++) {
+        const LatLon<T, Unit::deg> target(lat, H_->lon() + x / T(n));
+        const T d = DL[x, y];
+        res.h[x - res.x0, y - res.y0] = std::fmod(h_offset + bearing(S.standpoint, target.to_rad()), 2 * pi) - invis_angle / 2;
+        res.v[x - res.x0, y - res.y0] = v_offset - angle_v(S.z_standpoint_m, HL[x, y] - curvature_drop(d), d);
+      }
+    }
+    const auto [h_min, h_max] = std::minmax_element(res.h.begin(), res.h.end());
+    const auto [v_min, v_max] = std::minmax_element(res.v.begin(), res.v.end());
+    res.h_min = *h_min, res.h_max = *h_max;
+    res.v_min = *v_min, res.v_max = *v_max;
+    return res;
+  }
+
+  const tile<int16_t>* H_ = nullptr;
+  const distance_field<T>* D_ = nullptr;
+  const lod_pyramid<T>* lod_ = nullptr;
+  int64_t stride_ = 0; // blocks per level
+  mutable std::vector<block_angles> blocks_;
+  mutable std::unique_ptr<std::once_flag[]> once_;
+  mutable std::vector<rtin<T>> meshes_;
+  mutable std::unique_ptr<std::once_flag[]> mesh_once_;
+};
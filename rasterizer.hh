@@ -0,0 +1,161 @@
+#pragma once
+
+#include "simd.hh"
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <cstdint>
+
+// Half-space rasterization of triangles.  A pixel belongs to a triangle if its
+// centre is on the inner side of all three edges.  The vertices are snapped to
+// 1/256 px, hence the edge functions are integers at pixel centres and
+// evaluated exactly (in double, which is exact up to 2^53).  Pixels on an edge
+// are assigned to only one of the two triangles which share it, such that
+// neighbouring triangles neither overlap nor leave gaps.
+//
+// Edge functions are linear, hence they are stepped incrementally along rows
+// and columns, and simd::double_v::width pixels of a row are tested at once.
+namespace raster {
+
+constexpr double subpixels = 256; // per pixel and direction
+
+struct vertex {
+  double x, y; // [1/256 px]
+
+  vertex() = default;
+  template <typename T>
+  vertex(T px, T py): x(std::floor(px * subpixels + 0.5)), y(std::floor(py * subpixels + 0.5)) {}
+};
+
+// E(x, y) = a x + b y + c, positive to the left of p->q (with y pointing down)
+struct edge {
+  double a = 0, b = 0, c = 0;
+
+  edge() = default;
+  edge(vertex p, vertex q): a(p.y - q.y), b(q.x - p.x), c(p.x * q.y - p.y * q.x) {}
+
+  double operator()(double x, double y) const { return a * x + b * y + c; }
+  edge operator-() const {
+    edge res;
+    res.a = -a, res.b = -b, res.c = -c;
+    return res;
+  }
+};
+
+// pixels [x0, x1) x [y0, y1) whose centres may lie in a primitive with the
+// bounding box [xmin, xmax] x [ymin, ymax] [px], allowing for the snapping of
+// its vertices.  Nothing but this is needed to discard most primitives which
+// are smaller than a pixel.
+struct pixel_range {
+  int64_t x0, x1, y0, y1;
+
+  template <typename T>
+  pixel_range(T xmin, T xmax, T ymin, T ymax): x0(std::ceil(xmin - T(0.5) - T(1 / subpixels))), x1(std::floor(xmax - T(0.5) + T(1 / subpixels)) + 1),
+                                               y0(std::ceil(ymin - T(0.5) - T(1 / subpixels))), y1(std::floor(ymax - T(0.5) + T(1 / subpixels)) + 1) {}
+
+  int64_t size() const { return x0 < x1 && y0 < y1 ? (x1 - x0) * (y1 - y0) : 0; }
+};
+
+// the inside of a triangle, as the intersection of the inner sides of its edges
+class half_spaces {
+public:
+  half_spaces() = default;
+  // e12 is edge(v1, v2), when it is shared with another triangle
+  half_spaces(vertex v0, vertex v1, vertex v2, const edge& e12): e_{e12, edge(v2, v0), edge(v0, v1)} {
+    const double area2 = e_[0](v0.x, v0.y);
+    if (area2 == 0) {
+      degenerate_ = true;
+      return;
+    }
+    for (edge& e : e_) {
+      if (area2 < 0)
+        e = -e;
+      // exactly one of two triangles sharing an edge owns the pixel centres on it
+      if (!(e.a > 0 || (e.a == 0 && e.b > 0)))
+        e.c -= 1;
+    }
+  }
+
+  // is the centre of pixel (x, y) inside?
+  bool contains(int64_t x, int64_t y) const {
+    const double sx = x * subpixels + subpixels / 2, sy = y * subpixels + subpixels / 2;
+    return !degenerate_ && e_[0](sx, sy) >= 0 && e_[1](sx, sy) >= 0 && e_[2](sx, sy) >= 0;
+  }
+
+protected:
+  edge e_[3]; // opposite of v0, v1, v2
+  bool degenerate_ = false;
+};
+
+class triangle: public half_spaces {
+public:
+  triangle(vertex v0, vertex v1, vertex v2): triangle(v0, v1, v2, edge(v1, v2)) {}
+  // e12 is edge(v1, v2), when it is shared with another triangle
+  triangle(vertex v0, vertex v1, vertex v2, const edge& e12): half_spaces(v0, v1, v2, e12) {
+    if (degenerate_)
+      return;
+    xmin_ = std::ceil(std::min({v0.x, v1.x, v2.x}) / subpixels - 0.5);
+    xmax_ = std::floor(std::max({v0.x, v1.x, v2.x}) / subpixels - 0.5) + 1;
+    ymin_ = std::ceil(std::min({v0.y, v1.y, v2.y}) / subpixels - 0.5);
+    ymax_ = std::floor(std::max({v0.y, v1.y, v2.y}) / subpixels - 0.5) + 1;
+  }
+
+  // pixels [xmin, xmax) x [ymin, ymax) which may be covered
+  int64_t xmin() const { return xmin_; }
+  int64_t xmax() const { return xmax_; }
+  int64_t ymin() const { return ymin_; }
+  int64_t ymax() const { return ymax_; }
+  bool empty() const { return xmin_ >= xmax_ || ymin_ >= ymax_; }
+
+  // calls f(x, y) for every covered pixel within [x_begin, x_end) x [y_begin, y_end), row by row
+  template <typename F>
+  void for_each_pixel(int64_t x_begin, int64_t x_end, int64_t y_begin, int64_t y_end, F&& f) const {
+    using simd::double_v;
+    constexpr int64_t w = double_v::width;
+    static constexpr double lanes[16] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15};
+    static_assert(w <= 16);
+    const int64_t x0 = std::max(xmin_, x_begin), x1 = std::min(xmax_, x_end);
+    const int64_t y0 = std::max(ymin_, y_begin), y1 = std::min(ymax_, y_end);
+    if (x0 >= x1 || y0 >= y1)
+      return;
+    if (x1 - x0 == 1 && y1 - y0 == 1) { // common for distant triangles, not worth any setup
+      if (contains(x0, y0))
+        f(x0, y0);
+      return;
+    }
+
+    double_v step_lane[3], step_vector[3];
+    for (int i = 0; i < 3; i++) {
+      step_lane[i] = double_v::load(lanes) * double_v(e_[i].a * subpixels);
+      step_vector[i] = double_v(e_[i].a * subpixels * w);
+    }
+    const double sx0 = x0 * subpixels + subpixels / 2;
+    for (int64_t y = y0; y < y1; y++) {
+      const double sy = y * subpixels + subpixels / 2;
+      double_v E[3];
+      for (int i = 0; i < 3; i++)
+        E[i] = double_v(e_[i](sx0, sy)) + step_lane[i];
+      bool inside = false;
+      for (int64_t x = x0; x < x1; x += w) {
+        uint32_t bits = simd::nonnegative(simd::min(simd::min(E[0], E[1]), E[2]));
+        if (x1 - x < w)
+          bits &= (uint32_t(1) << (x1 - x)) - 1;
+        if (bits) {
+          inside = true;
+          for (; bits; bits &= bits - 1)
+            f(x + std::countr_zero(bits), y);
+        }
+        else if (inside) { // triangles are convex, the rest of the row is outside
+          break;
+        }
+        for (int i = 0; i < 3; i++)
+          E[i] = E[i] + step_vector[i];
+      }
+    }
+  }
+
+private:
+  int64_t xmin_ = 0, xmax_ = 0, ymin_ = 0, ymax_ = 0;
+};
+
+} // namespace raster
@@ -0,0 +1,93 @@
+#pragma once
+
+#include "array2d.hh"
+#include <algorithm>
+#include <bit>
+#include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstdlib>
+
+// Right-triangulated irregular network of a square grid with 2^k cells per
+// side, like Martini (Mapbox).  Starting from the two halves of the square,
+// right triangles are split at the midpoint of their hypotenuse, down to half
+// cells.  Every vertex is the midpoint of some hypotenuse, and for every
+// vertex a bound of the height error [m] of not splitting there is stored: of
+// the deviation of any vertex from the plane of the triangle, or of the
+// triangles below.  Hence the mesh for any tolerance is extracted in one
+// descent, and as the two triangles which share a hypotenuse look up the same
+// vertex, both or neither are split, and the mesh has no T-junctions inside
+// the square.  A hypotenuse on the border of the square has one triangle only,
+// hence the meshes of two neighbouring squares, or with different tolerances,
+// may split their common edge differently.  Along it, they still deviate by at
+// most the sum of their tolerances from each other.
+template <typename T>
+class rtin {
+public:
+  rtin() = default;
+  // height(x, y) for x, y in [0, cells]
+  template <typename Height>
+  rtin(int64_t cells, Height&& height): errors_(cells + 1, cells + 1, 0) {
+    assert(std::has_single_bit(uint64_t(cells)));
+    // the triangles form a binary tree, with 2 roots and cells^2 leaves,
+    // whose hypotenuse is the diagonal of two cells.  Children come before
+    // their parents, backwards.
+    const int64_t n_leaves = cells * cells, n_triangles = 2 * n_leaves - 2;
+    for (int64_t i = n_triangles - 1; i >= 0; i--) {
+      int64_t id = i + 2; // the path from the root, in binary
+      int64_t ax = 0, ay = 0, bx = 0, by = 0, cx = 0, cy = 0;
+      if (id & 1)
+        bx = by = cx = cells;
+      else
+        ax = ay = cy = cells;
+      while ((id >>= 1) > 1) {
+        const int64_t mx = (ax + bx) / 2, my = (ay + by) / 2;
+        if (id & 1) { // left half
+          bx = ax, by = ay;
+          ax = cx, ay = cy;
+        }
+        else { // right half
+          ax = bx, ay = by;
+          bx = cx, by = cy;
+        }
+        cx = mx, cy = my;
+      }
+      // The plane of a child differs from the plane of the triangle by the
+      // error at the midpoint of the hypotenuse, at most, hence the vertices
+      // in the triangle deviate from its plane by at most that plus the
+      // larger error of the children.  Children which are half cells contain
+      // no vertices but their corners.
+      const int64_t mx = (ax + bx) / 2, my = (ay + by) / 2;
+      T error = std::abs((T(height(ax, ay)) + T(height(bx, by))) / 2 - T(height(mx, my)));
+      if (i < n_triangles - n_leaves)
+        error += std::max(errors_[(ax + cx) / 2, (ay + cy) / 2], errors_[(bx + cx) / 2, (by + cy) / 2]);
+      errors_[mx, my] = std::max(errors_[mx, my], error);
+    }
+  }
+
+  int64_t cells() const { return errors_.xs() - 1; }
+
+  // calls f(ax, ay, bx, by, cx, cy) for each triangle of the coarsest mesh
+  // that deviates at most max_error [m] from the grid, with the hypotenuse
+  // a-b and the right angle at c
+  template <typename F>
+  void for_each_triangle(T max_error, F&& f) const {
+    descend(0, 0, cells(), cells(), cells(), 0, max_error, f);
+    descend(cells(), cells(), 0, 0, 0, cells(), max_error, f);
+  }
+
+private:
+  template <typename F>
+  void descend(int64_t ax, int64_t ay, int64_t bx, int64_t by, int64_t cx, int64_t cy, T max_error, F& f) const {
+    const int64_t mx = (ax + bx) / 2, my = (ay + by) / 2;
+    if (std::abs(ax - cx) + std::abs(ay - cy) > 1 && errors_[mx, my] > max_error) {
+      descend(cx, cy, ax, ay, mx, my, max_error, f);
+      descend(bx, by, cx, cy, mx, my, max_error, f);
+    }
+    else {
+      f(ax, ay, bx, by, cx, cy);
+    }
+  }
+
+  array2D<T> errors_; // [m], per vertex
+};
@@ -1,12 +1,23 @@
 #include "scene.hh"
+#include "geometry.hh"
 #include "tile.hh"
+#include "tile_archive.hh"
+#include "tile_cache.hh"
+#include "tile_codec.hh"
 #include <algorithm>
+#include <atomic>
 #include <cmath>
+#include <condition_variable>
 #include <cstring>
 #include <exception>
 #include <filesystem>
 #include <fstream>
+#include <memory>
+#include <mutex>
 #include <ranges>
+#include <stdexcept>
+#include <string>
+#include <thread>
 #include <utility>
 
 namespace fs = std::filesystem;
@@ -18,76 +29,239 @@ inline bool file_accessable(const fs::path& fp) {
   return f.good();
 }
 
+// reads the required tiles on a few background threads, nearest tile first,
+// and records the order in which they become available
 template <typename T>
-scene<T>::scene(LatLon<T, Unit::rad> coords, T z, T vdirh, T vw, T vdirv, T vh, T vdist, const std::vector<elevation_source>& _sources): standpoint(coords), z_standpoint_m(z), view_dir_h(vdirh), view_width(vw), view_dir_v(vdirv), view_height(vh), view_range_m(vdist), sources(_sources) {
-  const std::vector<LatLon<int64_t, Unit::deg>> required_tiles = determine_required_tiles_v(view_width, view_range_m, view_dir_h, standpoint);
+class scene<T>::tile_stream {
+public:
+  tile_stream(scene<T>& S, std::vector<LatLon<int64_t, Unit::deg>> required_tiles, int n_threads): required_(std::move(required_tiles)), loaded_(required_.size(), false) {
+    S.tiles.resize(required_.size());
+    S.lods.resize(required_.size());
+    S.projections.resize(required_.size());
+    for (int i = 0; i < std::min<int>(n_threads, required_.size()); i++)
+      workers_.emplace_back([this, &S](std::stop_token stop) { work(S, stop); });
+  }
+
+  int64_t wait_for_nth(int64_t n) {
+    std::unique_lock lock(mtx_);
+    cv_.wait(lock, [&] { return std::ssize(arrived_) > n || error_; });
+    if (error_)
+      std::rethrow_exception(error_);
+    return arrived_[n];
+  }
+
+  void wait_for(int64_t index) {
+    if (index < 0)
+      return;
+    std::unique_lock lock(mtx_);
+    cv_.wait(lock, [&] { return loaded_[index] || error_; });
+    if (error_)
+      std::rethrow_exception(error_);
+  }
+
+  // reports the tile cache once everything is loaded, on the calling thread
+  // rather than on a worker
+  void wait_for_all() {
+    if (!required_.empty())
+      wait_for_nth(std::ssize(required_) - 1);
+    if (!reported_.exchange(true))
+      std::cout << "tile cache: " << tile_cache::instance().stats() << std::endl;
+  }
+
+private:
+  void work(scene<T>& S, std::stop_token stop) {
+    for (int64_t i = next_++; i < std::ssize(required_) && !stop.stop_requested(); i = next_++) {
+      try {
+        S.tiles[i] = S.read_elevation_tile(required_[i]);
+        S.lods[i] = lod_pyramid<T>(S.tiles[i].first, S.tiles[i].second);
+        S.projections[i] = tile_projection<T>(S.tiles[i].first, S.tiles[i].second, S.lods[i]);
+      }
+      catch (...) {
+        const std::scoped_lock lock(mtx_);
+        error_ = std::current_exception();
+        cv_.notify_all();
+        return;
+      }
+      const std::scoped_lock lock(mtx_);
+      loaded_[i] = true;
+      arrived_.push_back(i);
+      cv_.notify_all();
+    }
+  }
+
+  const std::vector<LatLon<int64_t, Unit::deg>> required_;
+  std::atomic<int64_t> next_ = 0;
+  std::mutex mtx_;
+  std::condition_variable cv_;
+  std::vector<bool> loaded_;
+  std::vector<int64_t> arrived_;
+  std::exception_ptr error_;
+  std::atomic<bool> reported_ = false;
+  std::vector<std::jthread> workers_; // last, such that they are joined before anything else is destroyed
+};
+
+
+template <typename T>
+scene<T>::scene(LatLon<T, Unit::rad> coords, T z, T vdirh, T vw, T vdirv, T vh, T vdist, const std::vector<elevation_source>& _sources, tile_loading loading, distance_storage distances): standpoint(coords), z_standpoint_m(z), view_dir_h(vdirh), view_width(vw), view_dir_v(vdirv), view_height(vh), view_range_m(vdist), sources(_sources), distance_mode(distances) {
+  std::vector<LatLon<int64_t, Unit::deg>> required_tiles = determine_required_tiles_v(view_width, view_range_m, view_dir_h, standpoint);
   std::cout << "required_tiles: " << required_tiles << std::endl;
-  tiles = read_elevation_data(required_tiles);
+  if (loading == tile_loading::pipelined) {
+    // near tiles cover most of the canvas and the standpoint tile is required for the elevation, so they go first
+    const auto distance_to_tile = [&](const LatLon<int64_t, Unit::deg> t) {
+      const auto [lat, lon] = standpoint.to_deg();
+      const LatLon<T, Unit::deg> nearest(std::clamp<T>(lat, t.lat(), t.lat() + 1), std::clamp<T>(lon, t.lon(), t.lon() + 1));
+      return distance_atan(standpoint, nearest.to_rad());
+    };
+    std::ranges::stable_sort(required_tiles, std::less{}, distance_to_tile);
+    build_directory(required_tiles);
+    const int io_threads = 4; // mostly waiting for the disk, or decoding
+    stream_ = std::make_unique<tile_stream>(*this, std::move(required_tiles), io_threads);
+  }
+  else {
+    build_directory(required_tiles);
+    tiles = read_elevation_data(required_tiles);
+    lods.resize(tiles.size());
+    projections.resize(tiles.size());
+#pragma omp parallel for
+    for (int64_t i = 0; i < std::ssize(tiles); i++) {
+      lods[i] = lod_pyramid<T>(tiles[i].first, tiles[i].second);
+      projections[i] = tile_projection<T>(tiles[i].first, tiles[i].second, lods[i]);
+    }
+    std::cout << "tile cache: " << tile_cache::instance().stats() << std::endl;
+  }
   if (z_standpoint_m == -1) {
     const T z_offset = 10.0; // assume we are floating in some metres above ground to avoid artefacts
     z_standpoint_m = elevation_at_standpoint() + z_offset;
     std::cout << "overwriting the elevation: " << z_standpoint_m << std::endl;
   }
 }
-template scene<float>::scene(LatLon<float, Unit::rad> coords, float z, float vdirh, float vw, float vdirv, float vh, float vdist, const std::vector<elevation_source>& _sources);
-template scene<double>::scene(LatLon<double, Unit::rad> coords, double z, double vdirh, double vw, double vdirv, double vh, double vdist, const std::vector<elevation_source>& _sources);
+template scene<float>::scene(LatLon<float, Unit::rad> coords, float z, float vdirh, float vw, float vdirv, float vh, float vdist, const std::vector<elevation_source>& _sources, tile_loading loading, distance_storage distances);
+template scene<double>::scene(LatLon<double, Unit::rad> coords, double z, double vdirh, double vw, double vdirv, double vh, double vdist, const std::vector<elevation_source>& _sources, tile_loading loading, distance_storage distances);
 
 
+// out of line, because tile_stream is incomplete in the header
 template <typename T>
-std::vector<std::pair<tile<T>, tile<T>>> scene<T>::read_elevation_data(const std::vector<LatLon<int64_t, Unit::deg>>& required_tiles) const {
-  std::vector<std::pair<tile<T>, tile<T>>> res(required_tiles.size());
+scene<T>::~scene() = default;
+template scene<float>::~scene();
+template scene<double>::~scene();
+
+
+template <typename T>
+void scene<T>::build_directory(const std::vector<LatLon<int64_t, Unit::deg>>& required_tiles) {
+  if (required_tiles.empty())
+    return;
+  const auto [lat_min, lat_max] = std::ranges::minmax(required_tiles | std::views::transform([](const auto& t) { return t.lat(); }));
+  const auto [lon_min, lon_max] = std::ranges::minmax(required_tiles | std::views::transform([](const auto& t) { return t.lon(); }));
+  directory_origin_ = {lat_min, lon_min};
+  directory_lats_ = lat_max - lat_min + 1;
+  directory_lons_ = lon_max - lon_min + 1;
+  directory_.assign(directory_lats_ * directory_lons_, -1);
+  for (const auto& [i, t] : std::views::enumerate(required_tiles))
+    directory_[(t.lat() - lat_min) * directory_lons_ + (t.lon() - lon_min)] = i;
+}
+template void scene<float>::build_directory(const std::vector<LatLon<int64_t, Unit::deg>>& required_tiles);
+template void scene<double>::build_directory(const std::vector<LatLon<int64_t, Unit::deg>>& required_tiles);
+
+
+template <typename T>
+int64_t scene<T>::wait_for_nth_tile(int64_t n) const {
+  if (!stream_)
+    return n;
+  return stream_->wait_for_nth(n);
+}
+template int64_t scene<float>::wait_for_nth_tile(int64_t n) const;
+template int64_t scene<double>::wait_for_nth_tile(int64_t n) const;
+
+
+template <typename T>
+void scene<T>::wait_for_tiles() const {
+  if (stream_)
+    stream_->wait_for_all();
+}
+template void scene<float>::wait_for_tiles() const;
+template void scene<double>::wait_for_tiles() const;
+
+
+template <typename T>
+std::vector<std::pair<tile<int16_t>, distance_field<T>>> scene<T>::read_elevation_data(const std::vector<LatLon<int64_t, Unit::deg>>& required_tiles) const {
+  std::vector<std::pair<tile<int16_t>, distance_field<T>>> res(required_tiles.size());
 #pragma omp parallel for shared(res)
   for (const auto& [tile_index, required_tile] : std::ranges::views::enumerate(required_tiles)) {
-    const auto [ref_lat, ref_lon] = required_tile;
-    fs::path path("hgt");
-    fs::path fn(std::string(ref_lat < 0 ? "S" : "N") + to_stringish_fixedwidth<std::string>(std::abs(ref_lat), 2) +
-                std::string(ref_lon < 0 ? "W" : "E") + to_stringish_fixedwidth<std::string>(std::abs(ref_lon), 3) + ".hgt");
-    bool source_found = false;
-    for (const auto& source : sources) {
-      fs::path filename_rel = path / elevation_source_folder[std::to_underlying(source)] / fn;
+    res[tile_index] = read_elevation_tile(required_tile);
+  }
+  return res;
+}
+
+
+template <typename T>
+std::pair<tile<int16_t>, distance_field<T>> scene<T>::read_elevation_tile(const LatLon<int64_t, Unit::deg> required_tile) const {
+  const auto [ref_lat, ref_lon] = required_tile;
+  fs::path path("hgt");
+  fs::path fn(std::string(ref_lat < 0 ? "S" : "N") + to_stringish_fixedwidth<std::string>(std::abs(ref_lat), 2) +
+              std::string(ref_lon < 0 ? "W" : "E") + to_stringish_fixedwidth<std::string>(std::abs(ref_lon), 3) + ".hgt");
+  for (const auto& source : sources) {
+    fs::path filename_rel = path / elevation_source_folder[std::to_underlying(source)] / fn;
+    const int64_t tile_size = 3600 / elevation_source_resolution[std::to_underlying(source)] + 1;
+
+    const auto t0 = std::chrono::high_resolution_clock::now();
+
+    // tiles are parsed only once per process
+    const tile_cache::value_type A = tile_cache::instance().get_or_load({required_tile, source}, [&]() -> tile_cache::value_type {
+      // archives are mapped already, no need to touch the file system
+      for (const auto& archive : tile_archive::registered()) {
+        if (auto view = archive->get(required_tile, source)) {
+          if (view->dim() != tile_size)
+            throw std::runtime_error(archive->path().string() + ": " + fn.string() + " has dimension " + std::to_string(view->dim()) + ", expected " + std::to_string(tile_size));
+          return view;
+        }
+      }
+      // compressed tiles are preferred, they are read faster
+      const fs::path filename_compressed = fs::path(filename_rel).replace_extension(".hgtc");
+      if (file_accessable(filename_compressed)) {
+        std::cout << "trying to read: " << filename_compressed.string() << " ..." << std::endl; // flush;
+        try {
+          return std::make_shared<const tile<int16_t>>(read_compressed_tile(filename_compressed, tile_size, required_tile));
+        }
+        catch (const std::runtime_error& e) {
+          throw std::runtime_error(filename_compressed.string() + ": " + e.what());
+        }
+      }
       // std::cout << fn_full << std::endl;
       if (!file_accessable(filename_rel))
-        continue;
-      source_found = true;
+        return nullptr;
+      std::cout << "trying to read: " << filename_rel.string() << " with dimension " << tile_size << " ..." << std::endl; // flush;
+      return std::make_shared<const tile<int16_t>>(filename_rel, tile_size, required_tile);
+    });
+    if (!A)
+      continue;
 
-      const auto t0 = std::chrono::high_resolution_clock::now();
+    // auto t2 = std::chrono::high_resolution_clock::now();
+    // fp_ms = t2 - t1;
+    // std::cout << "  reading " << std::string(FILENAME) << " took " << fp_ms.count() << " ms" << std::endl;
+    distance_field<T> dists(*A, standpoint, distance_mode);
+    // std::cout << " done" << std::endl;
 
-      int64_t tile_size = 3600 / elevation_source_resolution[std::to_underlying(source)] + 1;
+    auto t3 = std::chrono::high_resolution_clock::now();
+    // std::chrono::duration<double, std::milli>  fp_ms_2 = t3 - t2;
+    std::chrono::duration<double, std::milli> fp_ms_tot = t3 - t0;
+    // std::cout << "  adding tile took " << fp_ms_2.count() << " ms" << std::endl;
+    std::cout << "  reading + processing tile " << filename_rel.string() << " took " << fp_ms_tot.count() << " ms" << std::endl;
 
-      std::cout << "trying to read: " << filename_rel.string() << " with dimension " << tile_size << " ..." << std::endl; // flush;
-      const tile<int16_t> A(filename_rel, tile_size, required_tile);
-      // auto t2 = std::chrono::high_resolution_clock::now();
-      // fp_ms = t2 - t1;
-      // std::cout << "  reading " << std::string(FILENAME) << " took " << fp_ms.count() << " ms" << std::endl;
-      auto dists = A.get_distances(standpoint);
-      auto heights = A.curvature_adjusted_elevations(dists);
-      res[tile_index] = std::make_pair(std::move(heights), std::move(dists));
-      // std::cout << " done" << std::endl;
-
-      auto t3 = std::chrono::high_resolution_clock::now();
-      // std::chrono::duration<double, std::milli>  fp_ms_2 = t3 - t2;
-      std::chrono::duration<double, std::milli> fp_ms_tot = t3 - t0;
-      // std::cout << "  adding tile took " << fp_ms_2.count() << " ms" << std::endl;
-      std::cout << "  reading + processing tile " << filename_rel.string() << " took " << fp_ms_tot.count() << " ms" << std::endl;
-
-      break; // add only one version of each tile
-    }
-    if (!source_found) {
-      const std::string err{"no source for " + fn.string() + " found"};
-      std::cerr << err << std::endl;
-      throw std::runtime_error(err);
-    }
+    return std::make_pair(tile<int16_t>::shared_view(A), std::move(dists)); // add only one version of each tile
   }
-  return res;
+  const std::string err{"no source for " + fn.string() + " found"};
+  std::cerr << err << std::endl;
+  throw std::runtime_error(err);
 }
 
 
 template <typename T>
 T scene<T>::elevation_at_standpoint() const {
-  auto it = std::find_if(tiles.begin(), tiles.end(),
-                         [&](const auto& p) { return (p.first.lat() == std::floor(standpoint.to_deg().lat())) && (p.first.lon() == std::floor(standpoint.to_deg().lon())); });
-  if (it == tiles.end()) {
+  const int64_t t = tile_index(floor(standpoint.to_deg()));
+  if (stream_)
+    stream_->wait_for(t);
+  if (t < 0) {
     throw std::runtime_error("The tile containing the standpoint hasn't been loaded.");
   }
-  return (it->first).interpolate(standpoint.to_deg());
+  return tiles[t].first.interpolate(standpoint.to_deg());
 }
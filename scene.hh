@@ -1,21 +1,30 @@
 #pragma once
 
+#include "distance_field.hh"
+#include "elevation_source.hh"
 #include "latlon.hh"
+#include "lod_pyramid.hh"
+#include "projection.hh"
 #include "tile.hh"
 #include <algorithm>
 #include <cmath>
 #include <filesystem>
+#include <memory>
+#include <optional>
 #include <utility>
+#include <vector>
 
 namespace fs = std::filesystem;
 
-enum class elevation_source { srtm1,
-                              srtm3,
-                              view1,
-                              view3 };
-inline static std::vector<std::string> elevation_source_name = {"srtm1", "srtm3", "view1", "view3"};
-inline static std::vector<fs::path> elevation_source_folder = {"SRTM1v3.0", "SRTM3v3.0", "VIEW1", "VIEW3"};
-inline static std::vector<int> elevation_source_resolution = {1, 3, 1, 3};
+
+// eager: all tiles are read in the constructor
+// pipelined: tiles are read by background threads, nearest first, and the
+// renderer picks them up as they arrive, such that reading and rendering
+// overlap.  With rasterization::shared_atomic that is all of the rendering;
+// the other modes project and bin blocks as tiles arrive, but rasterize front
+// to back, and hence only once all tiles have been read.
+enum class tile_loading { eager,
+                          pipelined };
 
 
 // everything about the depicted landscape that has nothing to do with pixels yet
@@ -27,9 +36,25 @@ public:
   T view_dir_h, view_width, view_dir_v, view_height; // [rad], [rad], [rad], [rad]
   T view_range_m;
   std::vector<elevation_source> sources;          // list of subset of view1, view3, srtm1, srtm3 in some order: these are considered as source
-  std::vector<std::pair<tile<T>, tile<T>>> tiles; // heights, distances
+  distance_storage distance_mode;
+  // heights [m] as in the elevation data, without the earth's curvature, and
+  // distances.  With tile_loading::pipelined only complete after wait_for_tiles().
+  std::vector<std::pair<tile<int16_t>, distance_field<T>>> tiles;
+  std::vector<lod_pyramid<T>> lods;            // coarser versions of tiles, same order
+  std::vector<tile_projection<T>> projections; // angles of the vertices in tiles and lods, same order
+
+  scene(LatLon<T, Unit::rad> standpoint, T z, T vdirh, T vw, T vdirv, T vh, T vdist, const std::vector<elevation_source>& _sources, tile_loading loading = tile_loading::eager, distance_storage distances = distance_storage::materialized);
+  ~scene();
+
+  // background threads write into tiles
+  scene(const scene&) = delete;
+  scene& operator=(const scene&) = delete;
 
-  scene(LatLon<T, Unit::rad> standpoint, T z, T vdirh, T vw, T vdirv, T vh, T vdist, const std::vector<elevation_source>& _sources);
+  // index into tiles of the n-th tile that has been read, blocks until it has
+  // been read.  Several threads may wait for different n.
+  int64_t wait_for_nth_tile(int64_t n) const;
+  // blocks until all tiles have been read, rethrows if reading any of them failed
+  void wait_for_tiles() const;
 
   static std::set<LatLon<int64_t, Unit::deg>> determine_required_tiles(const T view_width, const T view_range, const T view_dir_h_rad, const LatLon<T, Unit::rad> standpoint) {
     const int samples_per_ray = 10;
@@ -54,7 +79,44 @@ public:
     return rt_v;
   }
 
-  std::vector<std::pair<tile<T>, tile<T>>> read_elevation_data(const std::vector<LatLon<int64_t, Unit::deg>>& required_tiles) const;
+  std::vector<std::pair<tile<int16_t>, distance_field<T>>> read_elevation_data(const std::vector<LatLon<int64_t, Unit::deg>>& required_tiles) const;
+  std::pair<tile<int16_t>, distance_field<T>> read_elevation_tile(LatLon<int64_t, Unit::deg> required_tile) const;
 
   T elevation_at_standpoint() const;
+
+  // index into tiles of the tile whose south west corner is coords, or -1 if
+  // it is not one of the required tiles.  Known before the tile has been read.
+  int64_t tile_index(LatLon<int64_t, Unit::deg> coords) const {
+    const int64_t i = coords.lat() - directory_origin_.lat(), j = coords.lon() - directory_origin_.lon();
+    if (i < 0 || i >= directory_lats_ || j < 0 || j >= directory_lons_)
+      return -1;
+    return directory_[i * directory_lons_ + j];
+  }
+
+  // [m], interpolated between the four surrounding vertices, or nothing
+  // without elevation data there.  Points on the border of a tile are taken
+  // from either tile which is available.  Like tiles, only complete after
+  // wait_for_tiles() with tile_loading::pipelined.
+  std::optional<T> elevation(LatLon<T, Unit::deg> point) const {
+    const auto [lat, lon] = point;
+    const int64_t lat0 = std::floor(lat), lon0 = std::floor(lon);
+    for (const auto& [dlat, dlon] : {std::pair{0, 0}, {-1, 0}, {0, -1}, {-1, -1}}) {
+      if ((dlat && lat != lat0) || (dlon && lon != lon0)) // not on that border
+        continue;
+      if (const int64_t t = tile_index({lat0 + dlat, lon0 + dlon}); t >= 0)
+        return tiles[t].first.interpolate(point);
+    }
+    return std::nullopt;
+  }
+
+private:
+  // indices into tiles, for every degree in the bounding box of the required
+  // tiles, row by row from the south west corner, -1 where there is no tile
+  void build_directory(const std::vector<LatLon<int64_t, Unit::deg>>& required_tiles);
+  LatLon<int64_t, Unit::deg> directory_origin_{0, 0};
+  int64_t directory_lats_ = 0, directory_lons_ = 0;
+  std::vector<int64_t> directory_;
+
+  class tile_stream;
+  std::unique_ptr<tile_stream> stream_; // only with tile_loading::pipelined
 };
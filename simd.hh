@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+
+#if defined(__AVX512F__) || defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+// Thin wrappers around the widest float and double registers the target
+// supports (AVX-512, AVX2, or plain scalars as fallback), such that kernels can
+// be written once.  Only what the kernels in this code need is provided.
+namespace simd {
+
+#if defined(__AVX512F__)
+
+struct float_v {
+  using mask_type = __mmask16;
+  static constexpr int64_t width = 16;
+  __m512 v;
+
+  float_v() = default;
+  float_v(__m512 x): v(x) {}
+  float_v(float x): v(_mm512_set1_ps(x)) {}
+
+  static float_v load(const float* p) { return _mm512_loadu_ps(p); }
+  void store(float* p) const { _mm512_storeu_ps(p, v); }
+
+  friend float_v operator+(float_v a, float_v b) { return _mm512_add_ps(a.v, b.v); }
+  friend float_v operator-(float_v a, float_v b) { return _mm512_sub_ps(a.v, b.v); }
+  friend float_v operator*(float_v a, float_v b) { return _mm512_mul_ps(a.v, b.v); }
+  friend float_v operator/(float_v a, float_v b) { return _mm512_div_ps(a.v, b.v); }
+  friend mask_type operator>(float_v a, float_v b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_GT_OQ); }
+  friend mask_type operator<(float_v a, float_v b) { return _mm512_cmp_ps_mask(a.v, b.v, _CMP_LT_OQ); }
+};
+
+inline float_v fma(float_v a, float_v b, float_v c) { return _mm512_fmadd_ps(a.v, b.v, c.v); } // a*b + c
+inline float_v sqrt(float_v a) { return _mm512_sqrt_ps(a.v); }
+inline float_v min(float_v a, float_v b) { return _mm512_min_ps(a.v, b.v); }
+inline float_v max(float_v a, float_v b) { return _mm512_max_ps(a.v, b.v); }
+inline float_v select(float_v::mask_type m, float_v a, float_v b) { return _mm512_mask_blend_ps(m, b.v, a.v); } // m ? a : b
+// bit i is set if lane i of m is
+inline uint32_t bits(float_v::mask_type m) { return m; }
+
+struct double_v {
+  static constexpr int64_t width = 8;
+  __m512d v;
+
+  double_v() = default;
+  double_v(__m512d x): v(x) {}
+  double_v(double x): v(_mm512_set1_pd(x)) {}
+
+  static double_v load(const double* p) { return _mm512_loadu_pd(p); }
+
+  friend double_v operator+(double_v a, double_v b) { return _mm512_add_pd(a.v, b.v); }
+  friend double_v operator*(double_v a, double_v b) { return _mm512_mul_pd(a.v, b.v); }
+};
+
+inline double_v min(double_v a, double_v b) { return _mm512_min_pd(a.v, b.v); }
+// bit i is set if lane i is >= 0
+inline uint32_t nonnegative(double_v a) { return _mm512_cmp_pd_mask(a.v, _mm512_setzero_pd(), _CMP_GE_OQ); }
+
+#elif defined(__AVX2__)
+
+struct float_v {
+  using mask_type = __m256;
+  static constexpr int64_t width = 8;
+  __m256 v;
+
+  float_v() = default;
+  float_v(__m256 x): v(x) {}
+  float_v(float x): v(_mm256_set1_ps(x)) {}
+
+  static float_v load(const float* p) { return _mm256_loadu_ps(p); }
+  void store(float* p) const { _mm256_storeu_ps(p, v); }
+
+  friend float_v operator+(float_v a, float_v b) { return _mm256_add_ps(a.v, b.v); }
+  friend float_v operator-(float_v a, float_v b) { return _mm256_sub_ps(a.v, b.v); }
+  friend float_v operator*(float_v a, float_v b) { return _mm256_mul_ps(a.v, b.v); }
+  friend float_v operator/(float_v a, float_v b) { return _mm256_div_ps(a.v, b.v); }
+  friend mask_type operator>(float_v a, float_v b) { return _mm256_cmp_ps(a.v, b.v, _CMP_GT_OQ); }
+  friend mask_type operator<(float_v a, float_v b) { return _mm256_cmp_ps(a.v, b.v, _CMP_LT_OQ); }
+};
+
+#if defined(__FMA__)
+inline float_v fma(float_v a, float_v b, float_v c) { return _mm256_fmadd_ps(a.v, b.v, c.v); } // a*b + c
+#else
+inline float_v fma(float_v a, float_v b, float_v c) { return a * b + c; }
+#endif
+inline float_v sqrt(float_v a) { return _mm256_sqrt_ps(a.v); }
+inline float_v min(float_v a, float_v b) { return _mm256_min_ps(a.v, b.v); }
+inline float_v max(float_v a, float_v b) { return _mm256_max_ps(a.v, b.v); }
+inline float_v select(float_v::mask_type m, float_v a, float_v b) { return _mm256_blendv_ps(b.v, a.v, m); } // m ? a : b
+// bit i is set if lane i of m is
+inline uint32_t bits(float_v::mask_type m) { return _mm256_movemask_ps(m); }
+
+struct double_v {
+  static constexpr int64_t width = 4;
+  __m256d v;
+
+  double_v() = default;
+  double_v(__m256d x): v(x) {}
+  double_v(double x): v(_mm256_set1_pd(x)) {}
+
+  static double_v load(const double* p) { return _mm256_loadu_pd(p); }
+
+  friend double_v operator+(double_v a, double_v b) { return _mm256_add_pd(a.v, b.v); }
+  friend double_v operator*(double_v a, double_v b) { return _mm256_mul_pd(a.v, b.v); }
+};
+
+inline double_v min(double_v a, double_v b) { return _mm256_min_pd(a.v, b.v); }
+// bit i is set if lane i is >= 0
+inline uint32_t nonnegative(double_v a) { return _mm256_movemask_pd(_mm256_cmp_pd(a.v, _mm256_setzero_pd(), _CMP_GE_OQ)); }
+
+#else
+
+struct float_v {
+  using mask_type = bool;
+  static constexpr int64_t width = 1;
+  float v;
+
+  float_v() = default;
+  float_v(float x): v(x) {}
+
+  static float_v load(const float* p) { return *p; }
+  void store(float* p) const { *p = v; }
+
+  friend float_v operator+(float_v a, float_v b) { return a.v + b.v; }
+  friend float_v operator-(float_v a, float_v b) { return a.v - b.v; }
+  friend float_v operator*(float_v a, float_v b) { return a.v * b.v; }
+  friend float_v operator/(float_v a, float_v b) { return a.v / b.v; }
+  friend mask_type operator>(float_v a, float_v b) { return a.v > b.v; }
+  friend mask_type operator<(float_v a, float_v b) { return a.v < b.v; }
+};
+
+inline float_v fma(float_v a, float_v b, float_v c) { return std::fma(a.v, b.v, c.v); } // a*b + c
+inline float_v sqrt(float_v a) { return std::sqrt(a.v); }
+inline float_v min(float_v a, float_v b) { return std::min(a.v, b.v); }
+inline float_v max(float_v a, float_v b) { return std::max(a.v, b.v); }
+inline float_v select(float_v::mask_type m, float_v a, float_v b) { return m ? a : b; }
+// bit i is set if lane i of m is
+inline uint32_t bits(float_v::mask_type m) { return m; }
+
+
+struct double_v {
+  static constexpr int64_t width = 1;
+  double v;
+
+  double_v() = default;
+  double_v(double x): v(x) {}
+
+  static double_v load(const double* p) { return *p; }
+
+  friend double_v operator+(double_v a, double_v b) { return a.v + b.v; }
+  friend double_v operator*(double_v a, double_v b) { return a.v * b.v; }
+};
+
+inline double_v min(double_v a, double_v b) { return std::min(a.v, b.v); }
+// bit i is set if lane i is >= 0
+inline uint32_t nonnegative(double_v a) { return a.v >= 0; }
+
+#endif
+
+
+// asin(x) for x in [0, 1], with a relative error of a few ulp (the cephes asinf
+// polynomial).  Above 0.5, asin(x) = pi/2 - 2 asin(sqrt((1-x)/2)).
+inline float_v asin_01(float_v x) {
+  const float_v half(0.5f);
+  const auto large = x > half;
+  const float_v z_large = (float_v(1.0f) - x) * half;
+  const float_v z = select(large, z_large, x * x);
+  const float_v s = select(large, sqrt(z_large), x);
+  float_v p(4.2163199048e-2f);
+  p = fma(p, z, float_v(2.4181311049e-2f));
+  p = fma(p, z, float_v(4.5470025998e-2f));
+  p = fma(p, z, float_v(7.4953002686e-2f));
+  p = fma(p, z, float_v(1.6666752422e-1f));
+  const float_v r = fma(p * z, s, s);
+  return select(large, float_v(1.5707963267948966f) - (r + r), r);
+}
+
+} // namespace simd
@@ -2,11 +2,39 @@
 #define CATCH_CONFIG_MAIN
 #include "/home/lukas/bin/Catch/single_include/catch.hpp"
 
+#include "array2d.hh"
 #include "auxiliary.hh"
+#include "canvas.hh"
 #include "colour.hh"
+#include "distance_field.hh"
 #include "geometry.hh"
+#include "lod_pyramid.hh"
+#include "mapitems.hh"
+#include "rasterizer.hh"
+#include "rtin.hh"
+#include "scene.hh"
+#include "tile.hh"
+#include "tile_archive.hh"
+#include "tile_cache.hh"
+#include "tile_codec.hh"
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <bit>
 #include <cassert>
+#include <chrono>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
 #include <fstream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <string>
+#include <thread>
+#include <utility>
 #include <vector>
 
 using namespace std;
@@ -104,3 +132,635 @@ TEST_CASE("rgb2hsv", "rgb2hsv") {
   CHECK(rgb2hsv(50, 150, 250)[1] == Approx(0.8));      // s
   CHECK(rgb2hsv(50, 150, 250)[2] == Approx(0.980392)); // v
 }
+
+
+// write a synthetic big endian .hgt file, go through the codec, and compare the
+// re-serialised result to the original bytes
+TEST_CASE("tile codec round trip", "codec") {
+  const int64_t dim = 1201;
+  const std::filesystem::path fn = std::filesystem::temp_directory_path() / "N47E010.hgt";
+  vector<char> hgt_bytes(dim * dim * 2);
+  for (int64_t y = 0; y < dim; y++) {
+    for (int64_t x = 0; x < dim; x++) {
+      int16_t v = 1500 + 800 * std::sin(x * 0.01) * std::cos(y * 0.007) + (x * 7 + y * 13) % 5;
+      if (x == 17 && y < 40)
+        v = -32768; // voids
+      const uint16_t be = std::endian::native == std::endian::little ? std::byteswap(std::bit_cast<uint16_t>(v)) : std::bit_cast<uint16_t>(v);
+      std::memcpy(&hgt_bytes[2 * (y * dim + x)], &be, 2);
+    }
+  }
+  ofstream(fn, ios::binary).write(hgt_bytes.data(), hgt_bytes.size());
+
+  const tile<int16_t> original(fn, dim, {47, 10});
+  const vector<uint8_t> encoded = encode_tile(original);
+  CHECK(encoded.size() < hgt_bytes.size() / 3);
+  const tile<int16_t> decoded = decode_tile(encoded, dim, {47, 10});
+  CHECK(decoded.dim() == dim);
+  CHECK(decoded.coord() == original.coord());
+
+  vector<char> decoded_bytes(dim * dim * 2);
+  for (int64_t i = 0; i < dim * dim; i++) {
+    const uint16_t be = std::endian::native == std::endian::little ? std::byteswap(std::bit_cast<uint16_t>(decoded[i])) : std::bit_cast<uint16_t>(decoded[i]);
+    std::memcpy(&decoded_bytes[2 * i], &be, 2);
+  }
+  CHECK(decoded_bytes == hgt_bytes);
+
+  // odd block sizes and extreme values
+  tile<int16_t> extremes(dim, dim, dim, {-5, -120});
+  for (int64_t i = 0; i < dim * dim; i++)
+    extremes[i] = i % 3 == 0 ? -32768 : (i % 3 == 1 ? 32767 : 0);
+  CHECK(std::ranges::equal(decode_tile(encode_tile(extremes, 7), dim, {-5, -120}), extremes));
+
+  vector<uint8_t> truncated(encoded.begin(), encoded.begin() + encoded.size() / 2);
+  CHECK_THROWS(decode_tile(truncated, dim, {47, 10}));
+
+  // block offsets which run backwards or past the payload
+  const size_t offsets_pos = 20;
+  vector<uint8_t> backwards = encoded;
+  std::fill_n(backwards.begin() + offsets_pos + 2 * sizeof(uint64_t), sizeof(uint64_t), uint8_t(0));
+  CHECK_THROWS(decode_tile(backwards, dim, {47, 10}));
+  vector<uint8_t> beyond = encoded;
+  std::fill_n(beyond.begin() + offsets_pos + sizeof(uint64_t), sizeof(uint64_t), uint8_t(0xff));
+  CHECK_THROWS(decode_tile(beyond, dim, {47, 10}));
+
+  // a header that claims another size is rejected before the tile is allocated
+  CHECK_THROWS(decode_tile(encoded, dim + 1, {47, 10}));
+  vector<uint8_t> huge = encoded;
+  const uint32_t huge_dim = 100000;
+  for (size_t i = 0; i < sizeof(huge_dim); i++)
+    huge[8 + i] = uint8_t(huge_dim >> (8 * i));
+  CHECK_THROWS(decode_tile(huge, dim, {47, 10}));
+
+  // a damaged block which still decodes to something: a byte missing from the
+  // first block, and a byte too many
+  const auto offset = [&](const vector<uint8_t>& bytes, int64_t b) {
+    uint64_t v = 0;
+    for (size_t i = 0; i < sizeof(uint64_t); i++)
+      v |= uint64_t(bytes[offsets_pos + b * sizeof(uint64_t) + i]) << (8 * i);
+    return v;
+  };
+  const auto set_offset = [&](vector<uint8_t>& bytes, int64_t b, uint64_t v) {
+    for (size_t i = 0; i < sizeof(uint64_t); i++)
+      bytes[offsets_pos + b * sizeof(uint64_t) + i] = uint8_t(v >> (8 * i));
+  };
+  vector<uint8_t> shorter = encoded;
+  set_offset(shorter, 1, offset(encoded, 1) - 1);
+  CHECK_THROWS(decode_tile(shorter, dim, {47, 10}));
+  vector<uint8_t> longer = encoded;
+  set_offset(longer, 1, offset(encoded, 1) + 1);
+  CHECK_THROWS(decode_tile(longer, dim, {47, 10}));
+  std::filesystem::remove(fn);
+}
+
+TEST_CASE("tile archive round trip", "archive") {
+  const int64_t dim = 121;
+  tile<int16_t> a(dim, dim, dim, {47, 10}), b(dim, dim, dim, {-5, -120});
+  for (int64_t i = 0; i < dim * dim; i++) {
+    a[i] = int16_t(i % 4000 - 500);
+    b[i] = int16_t(32767 - i);
+  }
+  const std::filesystem::path fn = std::filesystem::temp_directory_path() / "test.tiles";
+  {
+    tile_archive_writer writer(fn);
+    writer.add(a, elevation_source::srtm3);
+    writer.add(b, elevation_source::view1);
+  }
+
+  const tile_archive archive(fn);
+  CHECK(archive.size() == 2);
+  CHECK(archive.contains({47, 10}, elevation_source::srtm3));
+  CHECK(!archive.contains({47, 10}, elevation_source::srtm1));
+  CHECK(archive.get({47, 11}, elevation_source::srtm3) == nullptr);
+  const auto ta = archive.get({47, 10}, elevation_source::srtm3);
+  const auto tb = archive.get({-5, -120}, elevation_source::view1);
+  REQUIRE(ta);
+  REQUIRE(tb);
+  CHECK(ta->dim() == dim);
+  CHECK(tb->coord() == b.coord());
+  CHECK(std::ranges::equal(*ta, a));
+  CHECK(std::ranges::equal(*tb, b));
+
+  // damaged copies of the archive
+  vector<char> bytes(std::filesystem::file_size(fn));
+  ifstream(fn, ios::binary).read(bytes.data(), bytes.size());
+  const std::filesystem::path fn_damaged = std::filesystem::temp_directory_path() / "damaged.tiles";
+  const auto open_damaged = [&](const vector<char>& damaged) {
+    ofstream(fn_damaged, ios::binary | ios::trunc).write(damaged.data(), damaged.size());
+    return tile_archive(fn_damaged);
+  };
+  const auto put = [](vector<char>& damaged, size_t pos, auto v) { std::memcpy(&damaged[pos], &v, sizeof(v)); };
+  const uint64_t index_offset = bytes.size() - 2 * sizeof(archive_entry);
+  CHECK_NOTHROW(open_damaged(bytes));
+
+  CHECK_THROWS(open_damaged(vector<char>(bytes.begin(), bytes.begin() + sizeof(archive_header) - 1)));
+  CHECK_THROWS(open_damaged(vector<char>(bytes.begin(), bytes.end() - 1)));
+  vector<char> magic = bytes;
+  magic[0] = 'X';
+  CHECK_THROWS(open_damaged(magic));
+
+  // counts and offsets which wrap around when added up
+  vector<char> n_tiles = bytes;
+  put(n_tiles, offsetof(archive_header, n_tiles), uint64_t(1) << 61); // times 24 is 0
+  CHECK_THROWS(open_damaged(n_tiles));
+  vector<char> index_past_end = bytes;
+  put(index_past_end, offsetof(archive_header, index_offset), ~uint64_t(0) - 7);
+  CHECK_THROWS(open_damaged(index_past_end));
+  vector<char> tile_past_end = bytes;
+  put(tile_past_end, index_offset + offsetof(archive_entry, offset), ~uint64_t(0) - 1);
+  CHECK_THROWS(open_damaged(tile_past_end));
+  vector<char> huge_dim = bytes;
+  put(huge_dim, index_offset + offsetof(archive_entry, dim), uint32_t(0xffffffff));
+  CHECK_THROWS(open_damaged(huge_dim));
+
+  // misaligned index and tile
+  vector<char> misaligned_index = bytes;
+  misaligned_index.insert(misaligned_index.begin() + index_offset, 4, 0);
+  put(misaligned_index, offsetof(archive_header, index_offset), index_offset + 4);
+  CHECK_THROWS(open_damaged(misaligned_index));
+  vector<char> misaligned_tile = bytes;
+  put(misaligned_tile, index_offset + offsetof(archive_entry, offset), uint64_t(archive_alignment + 1));
+  CHECK_THROWS(open_damaged(misaligned_tile));
+
+  // the same tile twice, and an entry which does not name a tile
+  vector<char> duplicate = bytes;
+  std::memcpy(&duplicate[index_offset + sizeof(archive_entry)], &duplicate[index_offset], sizeof(archive_entry));
+  CHECK_THROWS(open_damaged(duplicate));
+  vector<char> source = bytes;
+  put(source, index_offset + offsetof(archive_entry, source), uint32_t(256 + std::to_underlying(elevation_source::view1)));
+  CHECK_THROWS(open_damaged(source));
+
+  std::filesystem::remove(fn);
+  std::filesystem::remove(fn_damaged);
+}
+
+TEST_CASE("tile cache", "cache") {
+  const int64_t dim = 11;
+  const size_t tile_bytes = dim * dim * sizeof(int16_t);
+  tile_cache cache(3 * tile_bytes);
+  int64_t loads = 0;
+  const auto loader = [&](int64_t lat, int64_t d) {
+    return [&loads, lat, d] {
+      loads++;
+      return std::make_shared<const tile<int16_t>>(d, d, d, LatLon<int64_t, Unit::deg>{lat, 10});
+    };
+  };
+  const auto key = [](int64_t lat) { return tile_cache::key_type{{lat, 10}, elevation_source::srtm3}; };
+
+  // hits and misses
+  const auto t1 = cache.get_or_load(key(1), loader(1, dim));
+  CHECK(cache.get_or_load(key(1), loader(1, dim)) == t1);
+  CHECK(loads == 1);
+  CHECK(cache.stats().hits == 1);
+  CHECK(cache.stats().misses == 1);
+  CHECK(cache.stats().bytes == tile_bytes);
+  CHECK(cache.get(key(2)) == nullptr);
+  CHECK(cache.get_or_load(key(2), [] { return tile_cache::value_type(); }) == nullptr);
+  CHECK(cache.stats().tiles == 1);
+
+  // the least recently used tile is evicted first
+  cache.get_or_load(key(2), loader(2, dim));
+  cache.get_or_load(key(3), loader(3, dim));
+  cache.get(key(1));
+  cache.get_or_load(key(4), loader(4, dim));
+  CHECK(cache.stats().evictions == 1);
+  CHECK(cache.get(key(2)) == nullptr);
+  CHECK(cache.get(key(1)) == t1);
+  CHECK(cache.get(key(3)) != nullptr);
+  CHECK(cache.get(key(4)) != nullptr);
+  cache.set_budget(2 * tile_bytes);
+  CHECK(cache.get(key(1)) == nullptr);
+  CHECK(cache.stats().tiles == 2);
+
+  // a tile larger than the budget is handed out, but neither cached nor evicting others
+  const auto large = cache.get_or_load(key(5), loader(5, 3 * dim));
+  CHECK(large != nullptr);
+  CHECK(cache.get(key(5)) == nullptr);
+  CHECK(cache.stats().tiles == 2);
+  CHECK(cache.stats().evictions == 2);
+
+  // views of mapped memory don't count against the budget
+  auto owner = std::make_shared<vector<int16_t>>(dim * dim);
+  cache.insert(key(6), std::make_shared<const tile<int16_t>>(dim, LatLon<int64_t, Unit::deg>{6, 10}, owner->data(), owner));
+  CHECK(cache.stats().tiles == 3);
+  CHECK(cache.stats().bytes == 2 * tile_bytes);
+
+  // concurrent loads of the same tile all end up with the cached one
+  cache.clear();
+  std::atomic<int64_t> concurrent_loads = 0;
+  vector<tile_cache::value_type> results(8);
+  vector<std::thread> threads;
+  for (auto& result : results)
+    threads.emplace_back([&] {
+      result = cache.get_or_load(key(7), [&] {
+        concurrent_loads++;
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        return std::make_shared<const tile<int16_t>>(dim, dim, dim, LatLon<int64_t, Unit::deg>{7, 10});
+      });
+    });
+  for (auto& thread : threads)
+    thread.join();
+  CHECK(concurrent_loads >= 1);
+  CHECK(std::ranges::all_of(results, [&](const auto& r) { return r != nullptr && r == cache.get(key(7)); }));
+  CHECK(cache.stats().tiles == 1);
+  CHECK(cache.stats().bytes == tile_bytes);
+}
+
+// views share their memory with the viewed array, arithmetic must not write to it
+TEST_CASE("views are read only", "views") {
+  auto owner = std::make_shared<vector<int16_t>>(vector<int16_t>{1, 2, 3, 4, 5, 6});
+  const array2D<int16_t> V(3, 2, owner->data(), owner);
+  const array2D<int16_t> A(3, 2, 10);
+  const array2D<int16_t> sum = V + A, diff = V - A;
+  CHECK(!sum.is_view());
+  CHECK(sum[2, 1] == 16);
+  CHECK(diff[0, 0] == -9);
+  CHECK(*owner == vector<int16_t>{1, 2, 3, 4, 5, 6});
+  array2D<int16_t> W(V);
+  CHECK_THROWS(W += A);
+  CHECK(*owner == vector<int16_t>{1, 2, 3, 4, 5, 6});
+
+  // a moved from array is empty, and not a view of null
+  const array2D<int16_t> X(std::move(W));
+  CHECK(X.is_view());
+  CHECK(X[1, 1] == 5);
+  CHECK(W.empty());
+  CHECK(!W.is_view());
+  CHECK(std::ranges::distance(std::as_const(W)) == 0);
+}
+
+TEST_CASE("simd distances", "distances") {
+  const int64_t dim = 1201;
+  const tile<int16_t> T(dim, dim, dim, {47, 10});
+  const LatLon<float, Unit::rad> standpoint = LatLon<float, Unit::deg>(47.3, 10.8).to_rad();
+  const tile<double> ref = T.get_distances(LatLon<double, Unit::rad>(standpoint), distance_kernel::scalar);
+  const tile<float> D = T.get_distances(standpoint, distance_kernel::simd);
+  for (int64_t y = 0; y < dim; y += 7)
+    for (int64_t x = 0; x < dim; x++)
+      CHECK(std::abs(D[x, y] - ref[x, y]) < 0.1);
+}
+
+// a plane is reproduced exactly, also on the north and east border, which
+// neighbouring tiles share
+TEST_CASE("interpolation up to the tile border", "interpolate") {
+  const int64_t dim = 121;
+  tile<int16_t> T(dim, dim, dim, {47, 10});
+  for (int64_t y = 0; y < dim; y++)
+    for (int64_t x = 0; x < dim; x++)
+      T[x, y] = 3 * x + 5 * y;
+  const auto plane = [&](double lat, double lon) { return 3 * (lon - 10) * (dim - 1) + 5 * (48 - lat) * (dim - 1); };
+  for (const auto& [lat, lon] : {std::pair{47.0, 10.0}, {47.5, 10.25}, {48.0, 10.5}, {47.5, 11.0}, {48.0, 11.0}, {47.0, std::nextafter(11.0, 0.0)}})
+    CHECK(std::abs(T.interpolate(LatLon<double, Unit::deg>(lat, lon)) - plane(lat, lon)) < 1e-6);
+}
+
+TEST_CASE("rasterizer is watertight", "raster") {
+  // a distorted grid of quads, split into two triangles each like in render_scene
+  const int64_t n = 40, spacing = 6, w = 300, h = 300;
+  const auto vertex = [&](int64_t i, int64_t j) {
+    const bool inner = i > 0 && i < n && j > 0 && j < n;
+    return raster::vertex(10 + i * spacing + (inner ? 1.2 * std::sin(i * 7.1 + j * 3.3) : 0), 10 + j * spacing + (inner ? 1.2 * std::cos(i * 2.9 - j * 5.7) : 0));
+  };
+  vector<int> covered(w * h, 0);
+  for (int64_t j = 0; j < n; j++) {
+    for (int64_t i = 0; i < n; i++) {
+      const raster::edge shared(vertex(i + 1, j), vertex(i, j + 1));
+      raster::triangle(vertex(i, j), vertex(i + 1, j), vertex(i, j + 1), shared).for_each_pixel(0, w, 0, h, [&](int64_t x, int64_t y) { covered[y * w + x]++; });
+      raster::triangle(vertex(i + 1, j + 1), vertex(i + 1, j), vertex(i, j + 1), shared).for_each_pixel(0, w, 0, h, [&](int64_t x, int64_t y) { covered[y * w + x]++; });
+    }
+  }
+  for (int64_t y = 0; y < h; y++) {
+    for (int64_t x = 0; x < w; x++) {
+      const bool inside = x + 0.5 > 10 && x + 0.5 < 10 + n * spacing && y + 0.5 > 10 && y + 0.5 < 10 + n * spacing;
+      if (inside)
+        CHECK(covered[y * w + x] == 1);
+      else
+        CHECK(covered[y * w + x] == 0);
+    }
+  }
+}
+
+// most quads of a fine grid are smaller than a pixel and splatted by
+// draw_quad, which covers the same pixels as the triangles it replaces
+TEST_CASE("sub-pixel quads cover like their triangles", "splat") {
+  const int64_t n = 200, w = 160, h = 160;
+  const double spacing = 0.7;
+  const auto position = [&](int64_t i, int64_t j) {
+    const bool inner = i > 0 && i < n && j > 0 && j < n;
+    return std::pair<float, float>(10 + i * spacing + (inner ? 0.2 * std::sin(i * 7.1 + j * 3.3) : 0), 10 + j * spacing + (inner ? 0.2 * std::cos(i * 2.9 - j * 5.7) : 0));
+  };
+  canvas_t<float> C(w, h);
+  vector<int> covered(w * h, 0);
+  for (int64_t j = 0; j < n; j++) {
+    for (int64_t i = 0; i < n; i++) {
+      const auto [x1, y1] = position(i, j);
+      const auto [x2, y2] = position(i + 1, j);
+      const auto [x3, y3] = position(i, j + 1);
+      const auto [x4, y4] = position(i + 1, j + 1);
+      C.draw_quad(x1, y1, x2, y2, x3, y3, x4, y4, 1, {255, 0, 0}, 1, {0, 0, 255});
+      const raster::vertex v1(x1, y1), v2(x2, y2), v3(x3, y3), v4(x4, y4);
+      const raster::edge shared(v2, v3);
+      raster::triangle(v1, v2, v3, shared).for_each_pixel(0, w, 0, h, [&](int64_t x, int64_t y) { covered[y * w + x]++; });
+      raster::triangle(v4, v2, v3, shared).for_each_pixel(0, w, 0, h, [&](int64_t x, int64_t y) { covered[y * w + x]++; });
+    }
+  }
+  for (int64_t y = 0; y < h; y++) {
+    for (int64_t x = 0; x < w; x++) {
+      const bool inside = x + 0.5 > 10 && x + 0.5 < 10 + n * spacing && y + 0.5 > 10 && y + 0.5 < 10 + n * spacing;
+      CHECK(covered[y * w + x] == (inside ? 1 : 0));
+      CHECK((C.zb(x, y) < std::numeric_limits<float>::max()) == inside);
+    }
+  }
+}
+
+TEST_CASE("adaptive mesh stays within the tolerance", "rtin") {
+  const int64_t cells = 32;
+  const auto height = [](int64_t x, int64_t y) { return int16_t(400 * std::sin(x * 0.11) * std::cos(y * 0.07) + 30 * std::sin(x * 0.9 + y * 1.3)); };
+  const rtin<double> mesh(cells, height);
+  for (const double tolerance : {0.0, 1.0, 10.0, 100.0}) {
+    // the triangles tile the square, every vertex of the grid is interpolated
+    // to within the tolerance by the triangle which contains it, and no vertex
+    // of one triangle lies on an edge of another
+    int64_t area2 = 0;
+    vector<int> corner((cells + 1) * (cells + 1), 0);
+    vector<array<int64_t, 6>> triangles;
+    mesh.for_each_triangle(tolerance, [&](int64_t ax, int64_t ay, int64_t bx, int64_t by, int64_t cx, int64_t cy) {
+      triangles.push_back({ax, ay, bx, by, cx, cy});
+      corner[ay * (cells + 1) + ax] = corner[by * (cells + 1) + bx] = corner[cy * (cells + 1) + cx] = 1;
+      const int64_t det = (bx - ax) * (cy - ay) - (cx - ax) * (by - ay);
+      area2 += std::abs(det);
+      for (int64_t y = std::min({ay, by, cy}); y <= std::max({ay, by, cy}); y++) {
+        for (int64_t x = std::min({ax, bx, cx}); x <= std::max({ax, bx, cx}); x++) {
+          const double u = double((x - ax) * (cy - ay) - (cx - ax) * (y - ay)) / det; // weight of b
+          const double v = double((bx - ax) * (y - ay) - (x - ax) * (by - ay)) / det; // weight of c
+          if (u < 0 || v < 0 || u + v > 1)
+            continue;
+          const double h = (1 - u - v) * height(ax, ay) + u * height(bx, by) + v * height(cx, cy);
+          CHECK(std::abs(h - height(x, y)) <= tolerance + 1e-9);
+        }
+      }
+    });
+    CHECK(area2 == 2 * cells * cells);
+    for (const auto& t : triangles) {
+      for (int i = 0; i < 3; i++) {
+        const int64_t x0 = t[2 * i], y0 = t[2 * i + 1], x1 = t[(2 * i + 2) % 6], y1 = t[(2 * i + 3) % 6];
+        const int64_t steps = std::max(std::abs(x1 - x0), std::abs(y1 - y0));
+        for (int64_t k = 1; k < steps; k++)
+          CHECK(corner[(y0 + k * (y1 - y0) / steps) * (cells + 1) + x0 + k * (x1 - x0) / steps] == 0);
+      }
+    }
+  }
+
+  int64_t n = 0;
+  rtin<double>(cells, [](int64_t, int64_t) { return 7; }).for_each_triangle(0, [&](auto...) { n++; });
+  CHECK(n == 2);
+}
+
+// two neighbouring blocks, cut with different tolerances, cover their common
+// edge once each, and along it their borders are as close as canvas_t's
+// skirts assume
+TEST_CASE("adaptive meshes of neighbouring blocks", "rtin seam") {
+  const int64_t cells = 32;
+  const auto height = [](int64_t x, int64_t y) { return int16_t(400 * std::sin(x * 0.11) * std::cos(y * 0.07) + 30 * std::sin(x * 0.9 + y * 1.3)); };
+  const rtin<double> west(cells, height), east(cells, [&](int64_t x, int64_t y) { return height(cells + x, y); });
+  for (const auto& [west_tolerance, east_tolerance] : {std::pair{0.0, 10.0}, {1.0, 100.0}, {10.0, 10.0}, {100.0, 5.0}}) {
+    // the border of a mesh on the common edge, from its edges at x == seam
+    const auto border = [&](const rtin<double>& mesh, double tolerance, int64_t seam) {
+      vector<double> profile(cells + 1, std::numeric_limits<double>::quiet_NaN());
+      int64_t length = 0;
+      mesh.for_each_triangle(tolerance, [&](int64_t ax, int64_t ay, int64_t bx, int64_t by, int64_t cx, int64_t cy) {
+        for (const auto& [x0, y0, x1, y1] : {std::array{ax, ay, bx, by}, {bx, by, cx, cy}, {cx, cy, ax, ay}}) {
+          if (x0 != seam || x1 != seam)
+            continue;
+          length += std::abs(y1 - y0);
+          for (int64_t y = std::min(y0, y1); y <= std::max(y0, y1); y++)
+            profile[y] = height(cells, y0) + double(y - y0) / (y1 - y0) * (height(cells, y1) - height(cells, y0));
+        }
+      });
+      CHECK(length == cells);
+      return profile;
+    };
+    const vector<double> w = border(west, west_tolerance, cells), e = border(east, east_tolerance, 0);
+    for (int64_t y = 0; y <= cells; y++)
+      CHECK(std::abs(w[y] - e[y]) <= west_tolerance + east_tolerance + 1e-9);
+  }
+}
+
+// every vertex of the tile is within the error of the level from the triangles
+// of the level which cover it, in every block it belongs to, also on the border
+// between blocks, and summits are never lowered
+TEST_CASE("coarser levels stay within their error", "lod") {
+  const int64_t dim = 257, slope = 3;
+  const LatLon<float, Unit::rad> corner = LatLon<float, Unit::deg>(48, 10).to_rad(); // north west, next to block (0, 0)
+  const int l_max = lod_pyramid<float>::max_levels;
+
+  // on a ramp every vertex of level l is the full tile 2^l-1 cells further
+  // uphill, and the error is the same in each block
+  tile<int16_t> ramp(dim, dim, dim, {47, 10});
+  for (int64_t y = 0; y < dim; y++)
+    for (int64_t x = 0; x < dim; x++)
+      ramp[x, y] = int16_t(1000 + slope * x);
+  const lod_pyramid<float> lod_ramp(ramp, distance_field<float>(ramp, corner, distance_storage::materialized));
+  REQUIRE(lod_ramp.levels() == l_max);
+  REQUIRE(lod_ramp.blocks() == 4);
+  for (int l = 1; l <= l_max; l++)
+    for (int64_t by = 0; by < lod_ramp.blocks(); by++)
+      for (int64_t bx = 0; bx < lod_ramp.blocks(); bx++)
+        CHECK(lod_ramp.error(l, bx, by) == Approx(slope * ((1 << l) - 1)));
+
+  // a ridge along one row of the full tile: every level keeps it at its full
+  // height, the blocks along it are off by the height of the ridge, and those
+  // out of its reach not at all
+  const int64_t ridge_y = 37;
+  const int16_t ground = 1000, ridge = 2000;
+  tile<int16_t> H(dim, dim, dim, {47, 10});
+  for (int64_t y = 0; y < dim; y++)
+    for (int64_t x = 0; x < dim; x++)
+      H[x, y] = y == ridge_y ? ridge : ground;
+  const lod_pyramid<float> lod(H, distance_field<float>(H, corner, distance_storage::materialized));
+  for (int l = 1; l <= l_max; l++) {
+    const tile<int16_t>& HL = lod.heights(l);
+    for (int64_t x = 0; x < HL.xs(); x++) {
+      int16_t column_max = ground;
+      for (int64_t y = 0; y < HL.ys(); y++)
+        column_max = std::max(column_max, HL[x, y]);
+      CHECK(column_max == ridge);
+    }
+    for (int64_t bx = 0; bx < lod.blocks(); bx++) {
+      CHECK(lod.error(l, bx, 0) == Approx(ridge - ground));
+      CHECK(lod.error(l, bx, 2) == 0);
+      CHECK(lod.error(l, bx, 3) == 0);
+    }
+  }
+
+  // seen from the north west corner of the tile, the block around the
+  // standpoint needs the full tile, the opposite one does with less
+  const float pixels_per_rad = 200, max_error_px = 1;
+  CHECK(lod_ramp.choose_level(0, 0, pixels_per_rad, max_error_px) == 0);
+  CHECK(lod_ramp.choose_level(3, 3, pixels_per_rad, max_error_px) > 0);
+  CHECK(lod_ramp.choose_level(3, 3, pixels_per_rad, max_error_px) >= lod_ramp.choose_level(1, 1, pixels_per_rad, max_error_px));
+  // a ridge higher than the pixel budget pins the blocks along it to the full tile
+  CHECK(lod.choose_level(0, 0, pixels_per_rad, max_error_px) == 0);
+  CHECK(lod.choose_level(3, 0, pixels_per_rad, max_error_px) == 0);
+}
+
+// srtm3 tiles N47E010 and N48E010 of smooth synthetic terrain, in hgt/ of a
+// temporary working directory, for as long as the object lives
+class synthetic_terrain {
+public:
+  synthetic_terrain(): previous_(std::filesystem::current_path()), dir_(std::filesystem::temp_directory_path() / "artpano-test") {
+    const int64_t dim = 1201;
+    std::filesystem::create_directories(dir_ / "hgt" / "SRTM3v3.0");
+    for (const int64_t lat : {47, 48}) {
+      vector<char> hgt_bytes(dim * dim * 2);
+      for (int64_t y = 0; y < dim; y++) {
+        for (int64_t x = 0; x < dim; x++) {
+          const int16_t v = height(lat + 1 - double(y) / (dim - 1), 10 + double(x) / (dim - 1));
+          const uint16_t be = std::endian::native == std::endian::little ? std::byteswap(std::bit_cast<uint16_t>(v)) : std::bit_cast<uint16_t>(v);
+          std::memcpy(&hgt_bytes[2 * (y * dim + x)], &be, 2);
+        }
+      }
+      ofstream(dir_ / "hgt" / "SRTM3v3.0" / ("N" + std::to_string(lat) + "E010.hgt"), ios::binary).write(hgt_bytes.data(), hgt_bytes.size());
+    }
+    std::filesystem::current_path(dir_);
+  }
+  ~synthetic_terrain() {
+    std::filesystem::current_path(previous_);
+    std::filesystem::remove_all(dir_);
+  }
+
+  static int16_t height(double lat, double lon) { return int16_t(900 + 500 * std::sin(lat * 37) * std::cos(lon * 23) + 150 * std::sin(lat * 210 + lon * 170)); }
+
+  // looking north from above the terrain, across the border of the tiles
+  static scene<float> make_scene() {
+    return scene<float>(LatLon<float, Unit::deg>(47.9, 10.5).to_rad(), 2200, deg2rad_v<float> * 90, deg2rad_v<float> * 90, deg2rad_v<float> * -4, deg2rad_v<float> * 16, 30000, {elevation_source::srtm3});
+  }
+
+private:
+  std::filesystem::path previous_, dir_;
+};
+
+TEST_CASE("cells and pick", "pick") {
+  const synthetic_terrain terrain;
+  const scene<float> S = synthetic_terrain::make_scene();
+  REQUIRE(S.tiles.size() == 2);
+  canvas_t<float> binned(600, 150), shared(600, 150);
+  binned.render_scene(S, rasterization::binned, terrain_mesh::adaptive, {}, true);
+  shared.render_scene(S, rasterization::shared_atomic, terrain_mesh::adaptive, {}, true);
+  CHECK(std::ranges::equal(binned.cells(), shared.cells()));
+
+  // the cell at each pixel is where the terrain is drawn, at the distance of
+  // the z buffer.  Give or take a few cells, and on coarser levels and
+  // grazing slopes the ground a pixel spans along the line of sight.
+  const array2D<float> Z = binned.zb();
+  const canvas<float> C("", std::move(binned));
+  int64_t picked = 0, picked_north = 0;
+  for (int64_t y = 0; y < C.ys(); y++) {
+    for (int64_t x = 0; x < C.xs(); x++) {
+      const auto p = C.pick(S, x, y);
+      if (Z[x, y] == std::numeric_limits<float>::max()) {
+        CHECK(!p);
+        continue;
+      }
+      REQUIRE(p);
+      picked++;
+      picked_north += p->first.lat() >= 48;
+      CHECK(std::abs(distance_atan(S.standpoint, p->first.to_rad()) - Z[x, y]) < 0.05 * Z[x, y] + 100);
+      CHECK(p->second == Approx(*S.elevation(p->first)));
+    }
+  }
+  CHECK(picked > C.xs() * C.ys() / 4);
+  CHECK(picked_north > 0);
+  CHECK(picked_north < picked);
+  CHECK(!C.pick(S, -1, 0));
+  CHECK(!C.pick(S, C.xs(), 0));
+  CHECK(!C.pick(S, 0, C.ys()));
+}
+
+// both modes resolve ties in depth to the smaller surface, not by the order
+// in which the blocks are drawn, hence they draw the same
+TEST_CASE("shared canvas renders like the binned one", "shared") {
+  const synthetic_terrain terrain;
+  const scene<float> S = synthetic_terrain::make_scene();
+  shading shade;
+  shade.hillshade = 0.7;
+  for (const terrain_mesh mesh : {terrain_mesh::grid, terrain_mesh::adaptive}) {
+    canvas_t<float> binned(600, 150), shared(600, 150);
+    binned.render_scene(S, rasterization::binned, mesh, shade);
+    shared.render_scene(S, rasterization::shared_atomic, mesh, shade);
+    CHECK(std::ranges::count(binned.zb(), std::numeric_limits<float>::max()) < binned.xs() * binned.ys() / 2);
+    CHECK(std::ranges::equal(binned.zb(), shared.zb()));
+    CHECK(std::ranges::equal(binned.wc(), shared.wc()));
+  }
+}
+
+// the simd prefilter of get_visible_peaks drops none of the peaks which
+// place_peak puts on the canvas
+TEST_CASE("visible peaks with and without the prefilter", "peaks") {
+  const synthetic_terrain terrain;
+  const scene<float> S = synthetic_terrain::make_scene();
+  // all around the standpoint, in and out of range, in front and behind
+  vector<point_feature<float>> peaks;
+  for (int64_t i = 0; i < 40; i++)
+    for (int64_t j = 0; j < 40; j++)
+      peaks.emplace_back(LatLon<float, Unit::deg>(47.5 + 0.02 * i, 10.0 + 0.025 * j), std::to_string(i) + "/" + std::to_string(j), 0);
+  const auto same = [](const vector<point_feature_on_canvas<float>>& a, const vector<point_feature_on_canvas<float>>& b) {
+    return std::ranges::equal(a, b, [](const auto& p, const auto& q) { return p.pf.name == q.pf.name && p.pf.elev == q.pf.elev && p.x == q.x && p.y == q.y && p.dist == q.dist; });
+  };
+
+  for (const bool record_cells : {false, true}) {
+    canvas_t<float> core(600, 150);
+    core.render_scene(S, rasterization::binned, terrain_mesh::adaptive, {}, record_cells);
+    canvas<float> C("", std::move(core));
+    vector<point_feature<float>> batched = peaks, one_by_one = peaks;
+    const auto [visible, obscured] = C.get_visible_peaks(batched, S);
+    vector<point_feature_on_canvas<float>> visible_all, obscured_all;
+    for (auto& peak : one_by_one)
+      if (auto placed = C.place_peak(peak, S))
+        (placed->second ? visible_all : obscured_all).push_back(std::move(placed->first));
+    CHECK(!visible.empty());
+    CHECK(!obscured.empty());
+    CHECK(std::ssize(visible) + std::ssize(obscured) < std::ssize(peaks) / 2);
+    CHECK(same(visible, visible_all));
+    CHECK(same(obscured, obscured_all));
+  }
+}
+
+// neighbouring blocks on different levels of detail, and their adaptive
+// meshes, do not meet along the same edge.  Looking down on the terrain,
+// every pixel below the skyline has to be drawn.
+TEST_CASE("no gaps between blocks of different levels", "lod seam") {
+  const synthetic_terrain terrain;
+  const scene<float> S = synthetic_terrain::make_scene();
+  const int64_t xs = 600, ys = 150;
+  const float pixels_per_rad_v = ys / S.view_height, max_error_px = 1;
+  int64_t level_changes = 0;
+  for (const lod_pyramid<float>& lod : S.lods) {
+    for (int64_t by = 0; by < lod.blocks(); by++) {
+      for (int64_t bx = 0; bx + 1 < lod.blocks(); bx++) {
+        level_changes += lod.choose_level(bx, by, pixels_per_rad_v, max_error_px) != lod.choose_level(bx + 1, by, pixels_per_rad_v, max_error_px);
+        level_changes += lod.choose_level(by, bx, pixels_per_rad_v, max_error_px) != lod.choose_level(by, bx + 1, pixels_per_rad_v, max_error_px);
+      }
+    }
+  }
+  CHECK(level_changes > 0);
+
+  for (const terrain_mesh mesh : {terrain_mesh::grid, terrain_mesh::adaptive}) {
+    canvas_t<float> C(xs, ys);
+    C.render_scene(S, rasterization::binned, mesh);
+    // between the skyline and the lowest drawn pixel of each column
+    int64_t drawn = 0, gaps = 0;
+    for (int64_t x = 0; x < xs; x++) {
+      int64_t top = 0, bottom = ys;
+      while (top < ys && C.zb(x, top) == std::numeric_limits<float>::max())
+        top++;
+      while (bottom > top && C.zb(x, bottom - 1) == std::numeric_limits<float>::max())
+        bottom--;
+      for (int64_t y = top; y < bottom; y++) {
+        const bool gap = C.zb(x, y) == std::numeric_limits<float>::max();
+        drawn += !gap;
+        gaps += gap;
+      }
+    }
+    CHECK(drawn > xs * ys / 2);
+    CHECK(gaps == 0);
+  }
+}
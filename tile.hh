@@ -1,23 +1,42 @@
 #pragma once
 
+#include <algorithm>
 #include <bit>
 #include <cassert>
 #include <chrono>
 #include <cmath>
 #include <cstdint>
 #include <filesystem>
-#include <fstream>
 #include <iostream>
-#include <print>
+#include <memory>
 #include <ranges>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 #include <vector>
 
 #include "array2d.hh"
+#include "geometry.hh"
 #include "latlon.hh"
+#include "mapped_file.hh"
+#include "simd.hh"
 
 namespace fs = std::filesystem;
 
+// how tile::get_distances evaluates the distances
+enum class distance_kernel { scalar,
+                             simd };
+
+// the haversine formula for the distances from a standpoint to the vertices
+// of a tile separates into terms which depend on either the row or the column:
+//   a = sin^2(dlat/2) + cos(lat_s) cos(lat) sin^2(dlon/2) = R[y] + C[y] Q[x]
+//   d = 2 r asin(sqrt(a))
+template <typename U>
+struct haversine_terms {
+  std::vector<U> R, C; // per row
+  std::vector<U> Q;    // per column
+};
+
 // one tile only, without storing the viewpoint
 template <typename T>
 class tile: public array2D<T> {
@@ -29,28 +48,45 @@ public:
     assert(ys() == xs());
   }
 
-  tile(const fs::path& fn, int64_t _dim, LatLon<int64_t, Unit::deg> _coord): array2D<int16_t>(_dim, _dim), dim_(_dim), coord_(_coord) {
+  // view of dim*dim native samples at p, which remain valid as long as owner is alive
+  tile(int64_t _dim, LatLon<int64_t, Unit::deg> _coord, const T* p, std::shared_ptr<const void> owner): array2D<T>(_dim, _dim, p, std::move(owner)), dim_(_dim), coord_(_coord) {}
+
+  // view of a tile that is shared with others (eg, in the tile cache), which
+  // keeps it alive.
+  static tile shared_view(std::shared_ptr<const tile> t) {
+    if (t->is_view())
+      return *t;
+    const int64_t dim = t->dim();
+    const LatLon<int64_t, Unit::deg> coord = t->coord();
+    const T* p = t->begin();
+    return tile(dim, coord, p, std::move(t));
+  }
+
+  // .hgt files are plain big endian int16 arrays.  The file is mapped, and on
+  // big endian machines the tile is a view of the mapped pages without any
+  // copies.  Otherwise the samples are byte swapped from the mapping into the
+  // tile in one (vectorisable) pass.
+  tile(const fs::path& fn, int64_t _dim, LatLon<int64_t, Unit::deg> _coord): dim_(_dim), coord_(_coord) {
     // auto t0 = std::chrono::high_resolution_clock::now();
 
     assert(dim_ > 0);
     // std::cout << " dimension in tile: " << dim_ << std::endl;
     const int64_t size = dim_ * dim_;
 
-    std::ifstream ifs(fn.string(), std::ios::in | std::ios::binary);
-    ifs.exceptions(std::ifstream::failbit | std::ifstream::badbit);
-    try {
-      ifs.read(std::bit_cast<char*>(array2D<T>::data().data()), size * sizeof(int16_t));
+    const auto file = std::make_shared<const mapped_file>(fn);
+    if (file->size() != size * sizeof(int16_t)) {
+      throw std::runtime_error("unexpected size of " + fn.string() + ": " + std::to_string(file->size()) + " bytes");
     }
-    catch (const std::ifstream::failure& e) {
-      std::print("Exception opening/reading file {}\n", fn.string());
-    }
-    ifs.close();
 
-    // assuming the file is big endian:
-    if (std::endian::native == std::endian::little) {
-      for (auto& v : *this) {
-        v = std::byteswap(v);
-      }
+    if constexpr (std::endian::native == std::endian::big) {
+      file->advise(MADV_WILLNEED);
+      static_cast<array2D<int16_t>&>(*this) = array2D<int16_t>(dim_, dim_, file->as<const int16_t>(), file);
+    }
+    else {
+      file->advise(MADV_SEQUENTIAL);
+      static_cast<array2D<int16_t>&>(*this) = array2D<int16_t>(dim_, dim_);
+      const uint16_t* src = file->as<const uint16_t>();
+      std::transform(src, src + size, this->begin(), [](uint16_t v) { return std::bit_cast<int16_t>(std::byteswap(v)); });
     }
 
     // auto t1 = std::chrono::high_resolution_clock::now();
@@ -63,23 +99,15 @@ public:
   constexpr auto coord() const noexcept { return coord_; }
   constexpr auto dim() const noexcept { return dim_; }
 
-  // viewfinder uses drop/m = 0.1695 m * (dist / miles)^2 to account for curvature and refraction
+  // matrix of distances [m] from standpoint to tile.  The simd kernel applies
+  // to float only, double is always computed by the scalar one.
   template <typename U>
   requires std::floating_point<U>
-  auto curvature_adjusted_elevations(const tile<U>& dists) const {
-    assert(ys() == dists.ys());
-    assert(xs() == dists.xs());
-    const U coeff = 0.065444 / 1000000.0; // = 0.1695 / 1.609^2  // m
-    tile<U> A(xs(), ys(), dim(), coord());
-    std::transform(this->begin(), this->end(), dists.begin(), A.begin(), [coeff](auto el, auto dist) { return el - coeff * dist * dist; });
-    return A;
-  }
-
-
-  // matrix of distances [m] from standpoint to tile
-  template <typename U>
-  requires std::floating_point<U>
-  auto get_distances(const LatLon<U, Unit::rad> standpoint) const {
+  auto get_distances(const LatLon<U, Unit::rad> standpoint, const distance_kernel kernel = distance_kernel::simd) const {
+    if constexpr (std::is_same_v<U, float>) {
+      if (kernel == distance_kernel::simd)
+        return get_distances_simd(standpoint);
+    }
     std::vector<U> longitudes(xs());
     std::vector<U> latitudes(ys());
     for (int64_t y = 0; y < ys(); y++)
@@ -104,8 +132,50 @@ public:
     return A;
   }
 
+  // the terms of the haversine formula per row and column of the tile, with
+  // the trigonometry in double
+  template <typename U>
+  haversine_terms<U> get_haversine_terms(const LatLon<U, Unit::rad> standpoint) const {
+    const auto [lat_s, lon_s] = standpoint;
+    haversine_terms<U> res{std::vector<U>(ys()), std::vector<U>(ys()), std::vector<U>(xs())};
+    for (int64_t y = 0; y < ys(); y++) {
+      const double lat_y = (lat() + 1 - y / double(ys() - 1)) * deg2rad_v<double>;
+      res.R[y] = std::pow(std::sin((lat_y - lat_s) / 2), 2);
+      res.C[y] = std::cos(double(lat_s)) * std::cos(lat_y);
+    }
+    for (int64_t x = 0; x < xs(); x++) {
+      const double lon_x = (lon() + x / double(xs() - 1)) * deg2rad_v<double>;
+      res.Q[x] = std::pow(std::sin((lon_x - lon_s) / 2), 2);
+    }
+    return res;
+  }
+
+  // the haversine terms per row and column, and whole rows of
+  // d = 2 r asin(sqrt(a)) in simd registers
+  tile<float> get_distances_simd(const LatLon<float, Unit::rad> standpoint) const {
+    const auto [R, C, Q] = get_haversine_terms(standpoint);
+
+    using simd::float_v;
+    constexpr float two_r = 2 * average_radius_earth<float>;
+    tile<float> A(ys(), xs(), dim(), coord());
+    for (int64_t y = 0; y < ys(); y++) {
+      const float_v r(R[y]), c(C[y]);
+      float* row = &A[0, y];
+      int64_t x = 0;
+      for (; x + float_v::width <= xs(); x += float_v::width) {
+        const float_v a = simd::min(simd::fma(c, float_v::load(&Q[x]), r), float_v(1.0f));
+        (float_v(two_r) * simd::asin_01(simd::sqrt(a))).store(row + x);
+      }
+      for (; x < xs(); x++)
+        row[x] = two_r * std::asin(std::sqrt(std::min(R[y] + C[y] * Q[x], 1.0f)));
+    }
+    return A;
+  }
+
 
-  // get elevation at lat_p, lon_p, given the correct tile
+  // get elevation at lat_p, lon_p, given a tile that contains the point,
+  // borders included.  Neighbouring tiles share their border vertices, hence
+  // on a border either tile gives the same elevation.
   // ij---aux1---ijj
   //        |
   //        p
@@ -115,12 +185,13 @@ public:
   constexpr auto interpolate(LatLon<U, Unit::deg> coord) const {
     const auto [lat_p, lon_p] = coord;
     // std::cout << lat_p <<", "<< lon_p <<", "<<floor(lat_p) << ", "<< lat() <<", " << floor(lon_p) <<", "<< lon_ << std::endl;
-    assert(std::floor(lat_p) == lat() && std::floor(lon_p) == lon()); // ie, we are in the right tile
-    int64_t dim_m1 = dim() - 1;                                       // we really need dim_-1 all the time
-    // get the surrounding four indices
-    int64_t y = dim_m1 - std::floor((lat_p - lat()) * dim_m1);
+    assert(lat_p >= lat() && lat_p <= lat() + 1 && lon_p >= lon() && lon_p <= lon() + 1); // ie, we are in the right tile
+    int64_t dim_m1 = dim() - 1;                                                            // we really need dim_-1 all the time
+    // get the surrounding four indices, the last cell for points on the
+    // north or east border
+    int64_t y = std::max<int64_t>(dim_m1 - std::floor((lat_p - lat()) * dim_m1), 1);
     int64_t yy = y - 1;
-    int64_t x = std::floor((lon_p - lon()) * dim_m1);
+    int64_t x = std::min<int64_t>(std::floor((lon_p - lon()) * dim_m1), dim_m1 - 1);
     int64_t xx = x + 1;
     U lon_frac = dim_m1 * (lon_p - lon()) - x;
     U lat_frac = dim_m1 * (lat_p - lat()) - (dim_m1 - y);
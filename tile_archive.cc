@@ -0,0 +1,120 @@
+#include "tile_archive.hh"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+namespace {
+std::mutex registry_mtx;
+std::vector<std::shared_ptr<const tile_archive>> registry;
+} // namespace
+
+
+tile_archive::tile_archive(const fs::path& fn): path_(fn), file_(std::make_shared<const mapped_file>(fn)) {
+  if (file_->size() < sizeof(archive_header))
+    throw std::runtime_error(fn.string() + " is too small to be a tile archive");
+  archive_header header;
+  std::memcpy(&header, file_->data(), sizeof(archive_header));
+  if (std::memcmp(header.magic, archive_magic, sizeof(archive_magic)) != 0)
+    throw std::runtime_error(fn.string() + " is not a tile archive");
+  if (header.version != archive_version)
+    throw std::runtime_error(fn.string() + " has unsupported version " + std::to_string(header.version));
+  if (header.byte_order != archive_bom)
+    throw std::runtime_error(fn.string() + " was written on a machine with different byte order");
+  // bounds are checked by subtraction and division, a corrupt header must not wrap around
+  const uint64_t size = file_->size();
+  if (header.index_offset > size || header.n_tiles > (size - header.index_offset) / sizeof(archive_entry))
+    throw std::runtime_error(fn.string() + " is truncated");
+  if (header.index_offset % alignof(archive_entry) != 0)
+    throw std::runtime_error(fn.string() + " has a misaligned index");
+
+  const auto* entries = file_->as<const archive_entry>(header.index_offset);
+  index_.reserve(header.n_tiles);
+  for (uint64_t i = 0; i < header.n_tiles; i++) {
+    const archive_entry& e = entries[i];
+    if (e.lat < -90 || e.lat >= 90 || e.lon < -180 || e.lon >= 180 || e.source >= elevation_source_name.size())
+      throw std::runtime_error(fn.string() + " has an invalid index entry");
+    if (e.offset > size || (e.dim > 0 && (size - e.offset) / sizeof(int16_t) / e.dim < e.dim))
+      throw std::runtime_error(fn.string() + " is truncated");
+    if (e.offset % alignof(int16_t) != 0)
+      throw std::runtime_error(fn.string() + " has a misaligned tile");
+    if (!index_.emplace(key({e.lat, e.lon}, elevation_source(e.source)), e).second)
+      throw std::runtime_error(fn.string() + " contains tile " + std::to_string(e.lat) + ", " + std::to_string(e.lon) + " twice");
+  }
+}
+
+
+std::shared_ptr<const tile<int16_t>> tile_archive::get(LatLon<int64_t, Unit::deg> coord, elevation_source source) const {
+  const auto it = index_.find(key(coord, source));
+  if (it == index_.end())
+    return nullptr;
+  const archive_entry& e = it->second;
+  return std::make_shared<const tile<int16_t>>(e.dim, coord, file_->as<const int16_t>(e.offset), file_);
+}
+
+
+void tile_archive::add(const fs::path& fn) {
+  auto archive = std::make_shared<const tile_archive>(fn);
+  std::cout << "using tile archive " << fn.string() << " with " << archive->size() << " tiles" << std::endl;
+  const std::scoped_lock lock(registry_mtx);
+  registry.push_back(std::move(archive));
+}
+
+
+std::vector<std::shared_ptr<const tile_archive>> tile_archive::registered() {
+  const std::scoped_lock lock(registry_mtx);
+  return registry;
+}
+
+
+tile_archive_writer::tile_archive_writer(const fs::path& fn): ofs_(fn, std::ios::out | std::ios::binary | std::ios::trunc) {
+  ofs_.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+  const archive_header placeholder{};
+  ofs_.write(reinterpret_cast<const char*>(&placeholder), sizeof(archive_header));
+}
+
+
+tile_archive_writer::~tile_archive_writer() {
+  if (!finished_) {
+    try {
+      finish();
+    }
+    catch (const std::exception& e) {
+      std::cerr << "could not finish tile archive: " << e.what() << std::endl;
+    }
+  }
+}
+
+
+void tile_archive_writer::pad_to(const uint64_t alignment) {
+  const uint64_t pos = ofs_.tellp();
+  const uint64_t padding = (alignment - pos % alignment) % alignment;
+  const std::vector<char> zeros(padding, 0);
+  ofs_.write(zeros.data(), padding);
+}
+
+
+void tile_archive_writer::add(const tile<int16_t>& t, const elevation_source source) {
+  assert(!finished_);
+  pad_to(archive_alignment);
+  entries_.push_back({int32_t(t.lat()), int32_t(t.lon()), uint32_t(std::to_underlying(source)), uint32_t(t.dim()), uint64_t(ofs_.tellp())});
+  ofs_.write(reinterpret_cast<const char*>(t.begin()), t.xs() * t.ys() * sizeof(int16_t));
+}
+
+
+void tile_archive_writer::finish() {
+  pad_to(alignof(archive_entry));
+  archive_header header{};
+  std::copy(std::begin(archive_magic), std::end(archive_magic), header.magic);
+  header.version = archive_version;
+  header.byte_order = archive_bom;
+  header.n_tiles = entries_.size();
+  header.index_offset = ofs_.tellp();
+  ofs_.write(reinterpret_cast<const char*>(entries_.data()), entries_.size() * sizeof(archive_entry));
+  ofs_.seekp(0);
+  ofs_.write(reinterpret_cast<const char*>(&header), sizeof(archive_header));
+  ofs_.close();
+  finished_ = true;
+}
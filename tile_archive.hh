@@ -0,0 +1,89 @@
+#pragma once
+
+#include "elevation_source.hh"
+#include "latlon.hh"
+#include "mapped_file.hh"
+#include "tile.hh"
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Many elevation tiles packed into one file, in native byte order, such that
+// the tiles can be used directly from the mapped file.
+//
+//   header:  magic, version, byte order mark, number of tiles, offset of the index
+//   tiles:   dim*dim int16 each, starting at page aligned offsets
+//   index:   one archive_entry per tile
+//
+// The whole archive is mapped once, and tiles are handed out as views of the
+// mapping, without any further open/stat/read per tile.
+struct archive_header {
+  char magic[8];
+  uint32_t version;
+  uint32_t byte_order; // archive_bom as written by the producing machine
+  uint64_t n_tiles;
+  uint64_t index_offset; // [B]
+};
+
+struct archive_entry {
+  int32_t lat, lon; // [deg], lower left corner
+  uint32_t source;  // elevation_source
+  uint32_t dim;
+  uint64_t offset; // [B]
+};
+
+inline constexpr char archive_magic[8] = {'A', 'R', 'T', 'P', 'A', 'N', 'O', 'T'};
+inline constexpr uint32_t archive_version = 1;
+inline constexpr uint32_t archive_bom = 0x01020304;
+inline constexpr uint64_t archive_alignment = 4096; // [B]
+
+
+class tile_archive {
+public:
+  explicit tile_archive(const fs::path& fn);
+
+  // view of the tile in the mapped archive, or nullptr if the archive doesn't contain it
+  std::shared_ptr<const tile<int16_t>> get(LatLon<int64_t, Unit::deg> coord, elevation_source source) const;
+
+  bool contains(LatLon<int64_t, Unit::deg> coord, elevation_source source) const { return index_.contains(key(coord, source)); }
+  int64_t size() const { return std::ssize(index_); }
+  const fs::path& path() const { return path_; }
+
+  // archives registered here are consulted by scene::read_elevation_data
+  // before looking for individual .hgt files
+  static void add(const fs::path& fn);
+  static std::vector<std::shared_ptr<const tile_archive>> registered();
+
+private:
+  static constexpr uint64_t key(LatLon<int64_t, Unit::deg> coord, elevation_source source) noexcept {
+    return ((uint64_t(coord.lat() + 90) * 360 + uint64_t(coord.lon() + 180)) << 8) | std::to_underlying(source);
+  }
+
+  fs::path path_;
+  std::shared_ptr<const mapped_file> file_;
+  std::unordered_map<uint64_t, archive_entry> index_;
+};
+
+
+// writes tiles to a new archive one by one, the index is written by finish()
+class tile_archive_writer {
+public:
+  explicit tile_archive_writer(const fs::path& fn);
+  ~tile_archive_writer();
+
+  void add(const tile<int16_t>& t, elevation_source source);
+  void finish();
+
+private:
+  void pad_to(uint64_t alignment);
+
+  std::ofstream ofs_;
+  std::vector<archive_entry> entries_;
+  bool finished_ = false;
+};
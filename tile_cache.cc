@@ -0,0 +1,75 @@
+#include "tile_cache.hh"
+#include <mutex>
+#include <utility>
+
+
+tile_cache& tile_cache::instance() {
+  static tile_cache cache;
+  return cache;
+}
+
+
+tile_cache::value_type tile_cache::get(const key_type& key) {
+  const std::scoped_lock lock(mtx_);
+  const auto it = index_.find(key);
+  if (it == index_.end())
+    return nullptr;
+  hits_++;
+  lru_.splice(lru_.begin(), lru_, it->second); // mark as most recently used
+  return it->second->second;
+}
+
+
+tile_cache::value_type tile_cache::insert(const key_type& key, value_type t) {
+  const std::scoped_lock lock(mtx_);
+  if (const auto it = index_.find(key); it != index_.end()) { // someone else was quicker
+    lru_.splice(lru_.begin(), lru_, it->second);
+    return it->second->second;
+  }
+  misses_++;
+  if (footprint(t) > budget_) // would evict itself immediately
+    return t;
+  lru_.emplace_front(key, t);
+  index_.emplace(key, lru_.begin());
+  bytes_ += footprint(t);
+  evict_locked();
+  return t;
+}
+
+
+void tile_cache::evict_locked() {
+  while (bytes_ > budget_ && !lru_.empty()) {
+    const auto& [key, t] = lru_.back();
+    bytes_ -= footprint(t);
+    index_.erase(key);
+    lru_.pop_back();
+    evictions_++;
+  }
+}
+
+
+void tile_cache::set_budget(size_t bytes) {
+  const std::scoped_lock lock(mtx_);
+  budget_ = bytes;
+  evict_locked();
+}
+
+
+size_t tile_cache::budget() const {
+  const std::scoped_lock lock(mtx_);
+  return budget_;
+}
+
+
+tile_cache::statistics tile_cache::stats() const {
+  const std::scoped_lock lock(mtx_);
+  return {hits_, misses_, evictions_, lru_.size(), bytes_};
+}
+
+
+void tile_cache::clear() {
+  const std::scoped_lock lock(mtx_);
+  lru_.clear();
+  index_.clear();
+  bytes_ = 0;
+}
@@ -0,0 +1,90 @@
+#pragma once
+
+#include "elevation_source.hh"
+#include "latlon.hh"
+#include "tile.hh"
+#include <compare>
+#include <cstdint>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <utility>
+
+
+// least recently used cache of raw elevation tiles, limited by the heap the
+// tiles occupy.  One instance is shared by all scenes in the process, such
+// that rendering several views of the same area reads each tile only once.
+class tile_cache {
+public:
+  using value_type = std::shared_ptr<const tile<int16_t>>;
+
+  struct key_type {
+    LatLon<int64_t, Unit::deg> coord;
+    elevation_source source;
+
+    constexpr auto operator<=>(const key_type&) const noexcept = default;
+  };
+
+  struct statistics {
+    uint64_t hits = 0;
+    uint64_t misses = 0; // tiles that had to be loaded
+    uint64_t evictions = 0;
+    size_t tiles = 0;
+    size_t bytes = 0;
+
+    friend std::ostream& operator<<(std::ostream& S, const statistics& st) {
+      S << st.hits << " hits, " << st.misses << " misses, " << st.evictions << " evictions, "
+        << st.tiles << " tiles / " << st.bytes / (1024 * 1024) << " MiB cached";
+      return S;
+    }
+  };
+
+  static constexpr size_t default_budget = size_t(2) << 30; // [B], about 80 SRTM1 tiles
+
+  explicit tile_cache(size_t budget = default_budget): budget_(budget) {}
+  tile_cache(const tile_cache&) = delete;
+  tile_cache& operator=(const tile_cache&) = delete;
+
+  // the process wide instance
+  static tile_cache& instance();
+
+  // return the cached tile, or call load(), cache and return its result.  The
+  // lock is not held while loading, so tiles can be loaded concurrently.
+  // load may return nullptr (eg, if the source doesn't provide the tile),
+  // which is returned but not cached.
+  template <typename F>
+  value_type get_or_load(const key_type& key, F&& load) {
+    if (value_type cached = get(key))
+      return cached;
+    value_type loaded = std::forward<F>(load)();
+    if (!loaded)
+      return loaded;
+    return insert(key, std::move(loaded));
+  }
+
+  // nullptr if the tile is not cached
+  value_type get(const key_type& key);
+
+  // returns the cached tile, which is a different one if another thread was quicker
+  value_type insert(const key_type& key, value_type t);
+
+  void set_budget(size_t bytes);
+  size_t budget() const;
+  statistics stats() const;
+  void clear();
+
+private:
+  // views of mapped files (archives, .hgt on big endian machines) don't occupy
+  // any heap, their pages belong to the page cache
+  static size_t footprint(const value_type& t) { return t->is_view() ? 0 : t->xs() * t->ys() * sizeof(int16_t); }
+  void evict_locked();
+
+  mutable std::mutex mtx_;
+  size_t budget_; // [B]
+  size_t bytes_ = 0;
+  std::list<std::pair<key_type, value_type>> lru_; // most recently used first
+  std::map<key_type, decltype(lru_)::iterator> index_;
+  uint64_t hits_ = 0, misses_ = 0, evictions_ = 0;
+};
@@ -0,0 +1,299 @@
+#include "tile_codec.hh"
+#include "mapped_file.hh"
+#include <algorithm>
+#include <array>
+#include <bit>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+constexpr int64_t chunk_size = 32; // samples per Rice parameter
+constexpr uint32_t max_k = 15;     // Rice parameters are stored in 4 bits
+constexpr uint32_t escape_q = 20;  // quotients from here on are followed by the raw value
+constexpr int raw_bits = 17;       // enough for any zigzagged difference of two int16
+
+// bits are written MSB first, hence the stream does not depend on the byte order
+class bit_writer {
+public:
+  explicit bit_writer(std::vector<uint8_t>& out): out_(out) {}
+
+  // count <= 32
+  void put(uint32_t bits, int count) {
+    acc_ = (acc_ << count) | bits;
+    n_ += count;
+    while (n_ >= 8) {
+      n_ -= 8;
+      out_.push_back(uint8_t(acc_ >> n_));
+    }
+    acc_ &= (uint64_t(1) << n_) - 1;
+  }
+
+  void put_unary(uint32_t q) {
+    for (; q >= 32; q -= 32)
+      put(0xFFFFFFFF, 32);
+    put(((uint32_t(1) << q) - 1) << 1, q + 1); // q ones and a zero
+  }
+
+  void flush() {
+    if (n_ > 0)
+      out_.push_back(uint8_t(acc_ << (8 - n_)));
+    acc_ = 0;
+    n_ = 0;
+  }
+
+private:
+  std::vector<uint8_t>& out_;
+  uint64_t acc_ = 0;
+  int n_ = 0;
+};
+
+// the next bit is the MSB of buf_, which holds n_ valid bits
+class bit_reader {
+public:
+  bit_reader(const uint8_t* begin, const uint8_t* end): begin_(begin), p_(begin), end_(end) { refill(); }
+
+  // bits taken by get and get_unary so far, including zeros beyond the end
+  int64_t bits_read() const { return (p_ - begin_ + padding_) * 8 - n_; }
+
+  // count <= 32
+  uint32_t get(int count) {
+    if (n_ < count)
+      refill();
+    const uint32_t v = count ? buf_ >> (64 - count) : 0;
+    buf_ <<= count;
+    n_ -= count;
+    return v;
+  }
+
+  // up to limit (< 32) ones, terminated by a zero unless the limit is reached
+  uint32_t get_unary(uint32_t limit) {
+    if (n_ < 32)
+      refill();
+    const uint32_t ones = std::countl_one(buf_);
+    if (ones >= limit) {
+      buf_ <<= limit;
+      n_ -= limit;
+      return limit;
+    }
+    buf_ <<= ones + 1;
+    n_ -= ones + 1;
+    return ones;
+  }
+
+private:
+  // at least 56 valid bits afterwards, zeros beyond the end of the input
+  void refill() {
+    if (end_ - p_ >= 8) {
+      uint64_t w;
+      std::memcpy(&w, p_, sizeof(w));
+      if constexpr (std::endian::native == std::endian::little)
+        w = std::byteswap(w);
+      buf_ |= w >> n_;
+      p_ += (63 - n_) >> 3;
+      n_ |= 56;
+    }
+    else {
+      while (n_ <= 56) {
+        if (p_ < end_)
+          buf_ |= uint64_t(*p_++) << (56 - n_);
+        else
+          padding_++;
+        n_ += 8;
+      }
+    }
+  }
+
+  const uint8_t* begin_;
+  const uint8_t* p_;
+  const uint8_t* end_;
+  int64_t padding_ = 0; // zero bytes beyond the end
+  uint64_t buf_ = 0;
+  int n_ = 0;
+};
+
+constexpr uint32_t zigzag(int32_t v) { return (uint32_t(v) << 1) ^ uint32_t(v >> 31); }
+constexpr int32_t unzigzag(uint32_t u) { return int32_t(u >> 1) ^ -int32_t(u & 1); }
+
+// median edge detector: a left, b up, c up-left; median(a, b, a+b-c) without branches
+constexpr int32_t predict(int32_t a, int32_t b, int32_t c) {
+  return std::clamp(a + b - c, std::min(a, b), std::max(a, b));
+}
+
+// prediction of sample (x, y), where y0 is the first row of the block
+inline int32_t predict_at(const int16_t* row, const int16_t* prev_row, int64_t x) {
+  if (!prev_row) // first row of the block
+    return x > 0 ? row[x - 1] : 0;
+  if (x == 0)
+    return prev_row[0];
+  return predict(row[x - 1], prev_row[x], prev_row[x - 1]);
+}
+
+uint32_t best_rice_parameter(std::span<const uint32_t> u) {
+  uint32_t best_k = 0;
+  uint64_t best_bits = std::numeric_limits<uint64_t>::max();
+  for (uint32_t k = 0; k <= max_k; k++) {
+    uint64_t bits = 0;
+    for (const uint32_t v : u) {
+      const uint32_t q = v >> k;
+      bits += q < escape_q ? q + 1 + k : escape_q + raw_bits;
+    }
+    if (bits < best_bits) {
+      best_bits = bits;
+      best_k = k;
+    }
+  }
+  return best_k;
+}
+
+void encode_block(const tile<int16_t>& t, int64_t y0, int64_t y1, std::vector<uint8_t>& out) {
+  const int64_t xs = t.xs();
+  bit_writer bw(out);
+  std::vector<uint32_t> u(xs);
+  for (int64_t y = y0; y < y1; y++) {
+    const int16_t* row = t.begin() + y * xs;
+    const int16_t* prev_row = y > y0 ? row - xs : nullptr;
+    for (int64_t x = 0; x < xs; x++)
+      u[x] = zigzag(int32_t(row[x]) - predict_at(row, prev_row, x));
+    for (int64_t x0 = 0; x0 < xs; x0 += chunk_size) {
+      const std::span<const uint32_t> chunk(u.begin() + x0, u.begin() + std::min(x0 + chunk_size, xs));
+      const uint32_t k = best_rice_parameter(chunk);
+      bw.put(k, 4);
+      for (const uint32_t v : chunk) {
+        const uint32_t q = v >> k;
+        if (q < escape_q) {
+          bw.put_unary(q);
+          bw.put(v & ((uint32_t(1) << k) - 1), k);
+        }
+        else {
+          bw.put((uint32_t(1) << escape_q) - 1, escape_q);
+          bw.put(v, raw_bits);
+        }
+      }
+    }
+  }
+  bw.flush();
+}
+
+// false if the block is not exactly as long as its samples need, then it
+// is damaged, even if it decodes to something
+bool decode_block(std::span<const uint8_t> in, tile<int16_t>& t, int64_t y0, int64_t y1) {
+  const int64_t xs = t.xs();
+  bit_reader br(in.data(), in.data() + in.size());
+  for (int64_t y = y0; y < y1; y++) {
+    int16_t* row = t.begin() + y * xs;
+    const int16_t* prev_row = y > y0 ? row - xs : nullptr;
+    for (int64_t x0 = 0; x0 < xs; x0 += chunk_size) {
+      const uint32_t k = br.get(4);
+      const int64_t x1 = std::min(x0 + chunk_size, xs);
+      for (int64_t x = x0; x < x1; x++) {
+        const uint32_t q = br.get_unary(escape_q);
+        const uint32_t v = q < escape_q ? (q << k) | br.get(k) : br.get(raw_bits);
+        row[x] = int16_t(predict_at(row, prev_row, x) + unzigzag(v));
+      }
+    }
+  }
+  return (br.bits_read() + 7) / 8 == int64_t(in.size());
+}
+
+template <typename U>
+void put_le(std::vector<uint8_t>& out, U v) {
+  for (size_t i = 0; i < sizeof(U); i++)
+    out.push_back(uint8_t(v >> (8 * i)));
+}
+
+template <typename U>
+U get_le(std::span<const uint8_t> in, size_t pos) {
+  if (pos + sizeof(U) > in.size())
+    throw std::runtime_error("compressed tile is truncated");
+  U v = 0;
+  for (size_t i = 0; i < sizeof(U); i++)
+    v |= U(in[pos + i]) << (8 * i);
+  return v;
+}
+
+} // namespace
+
+
+std::vector<uint8_t> encode_tile(const tile<int16_t>& t, const int64_t block_rows) {
+  assert(t.xs() == t.ys());
+  const int64_t n_blocks = (t.ys() + block_rows - 1) / block_rows;
+  std::vector<std::vector<uint8_t>> blocks(n_blocks);
+#pragma omp parallel for schedule(dynamic)
+  for (int64_t b = 0; b < n_blocks; b++) {
+    encode_block(t, b * block_rows, std::min((b + 1) * block_rows, t.ys()), blocks[b]);
+  }
+
+  std::vector<uint8_t> out(std::begin(codec_magic), std::end(codec_magic));
+  put_le<uint32_t>(out, codec_version);
+  put_le<uint32_t>(out, t.dim());
+  put_le<uint32_t>(out, block_rows);
+  put_le<uint32_t>(out, n_blocks);
+  uint64_t offset = 0;
+  for (const auto& block : blocks) {
+    put_le<uint64_t>(out, offset);
+    offset += block.size();
+  }
+  put_le<uint64_t>(out, offset);
+  for (const auto& block : blocks)
+    out.insert(out.end(), block.begin(), block.end());
+  return out;
+}
+
+
+tile<int16_t> decode_tile(std::span<const uint8_t> data, const int64_t expected_dim, LatLon<int64_t, Unit::deg> coord) {
+  if (data.size() < sizeof(codec_magic) || std::memcmp(data.data(), codec_magic, sizeof(codec_magic)) != 0)
+    throw std::runtime_error("not a compressed tile");
+  const uint32_t version = get_le<uint32_t>(data, 4);
+  if (version != codec_version)
+    throw std::runtime_error("unsupported version of compressed tile: " + std::to_string(version));
+  const int64_t dim = get_le<uint32_t>(data, 8);
+  if (dim != expected_dim)
+    throw std::runtime_error("compressed tile has dimension " + std::to_string(dim) + ", expected " + std::to_string(expected_dim));
+  const int64_t block_rows = get_le<uint32_t>(data, 12);
+  const int64_t n_blocks = get_le<uint32_t>(data, 16);
+  if (block_rows <= 0 || n_blocks != (dim + block_rows - 1) / block_rows)
+    throw std::runtime_error("corrupt header of compressed tile");
+  const size_t offsets_pos = 20;
+  const size_t payload_pos = offsets_pos + (n_blocks + 1) * sizeof(uint64_t);
+  if (payload_pos > data.size())
+    throw std::runtime_error("compressed tile is truncated");
+  // the offsets come from the file, every block has to lie within the payload
+  std::vector<uint64_t> offsets(n_blocks + 1);
+  for (int64_t b = 0; b <= n_blocks; b++) {
+    offsets[b] = get_le<uint64_t>(data, offsets_pos + b * sizeof(uint64_t));
+    if (b > 0 && offsets[b] < offsets[b - 1])
+      throw std::runtime_error("corrupt block offsets of compressed tile");
+  }
+  if (offsets.front() != 0 || offsets.back() > data.size() - payload_pos)
+    throw std::runtime_error("compressed tile is truncated");
+
+  tile<int16_t> t(dim, dim, dim, coord);
+  bool damaged = false;
+#pragma omp parallel for schedule(dynamic) reduction(|| : damaged)
+  for (int64_t b = 0; b < n_blocks; b++) {
+    if (!decode_block(data.subspan(payload_pos + offsets[b], offsets[b + 1] - offsets[b]), t, b * block_rows, std::min((b + 1) * block_rows, dim)))
+      damaged = true;
+  }
+  if (damaged)
+    throw std::runtime_error("corrupt payload of compressed tile");
+  return t;
+}
+
+
+void write_compressed_tile(const fs::path& fn, const tile<int16_t>& t) {
+  const std::vector<uint8_t> bytes = encode_tile(t);
+  std::ofstream ofs(fn, std::ios::out | std::ios::binary | std::ios::trunc);
+  ofs.exceptions(std::ofstream::failbit | std::ofstream::badbit);
+  ofs.write(reinterpret_cast<const char*>(bytes.data()), bytes.size());
+}
+
+
+tile<int16_t> read_compressed_tile(const fs::path& fn, const int64_t dim, LatLon<int64_t, Unit::deg> coord) {
+  const mapped_file file(fn);
+  file.advise(MADV_SEQUENTIAL);
+  return decode_tile({file.as<const uint8_t>(), file.size()}, dim, coord);
+}
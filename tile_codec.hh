@@ -0,0 +1,35 @@
+#pragma once
+
+#include "latlon.hh"
+#include "tile.hh"
+#include <cstdint>
+#include <filesystem>
+#include <span>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+// Lossless compression of elevation tiles (.hgtc next to the .hgt files).
+//
+// Each sample is predicted from its left, upper and upper-left neighbours
+// (the median edge detector from LOCO-I), and the residuals are Rice coded
+// with one parameter per run of 32 samples.  The tile is cut into blocks of
+// rows which are coded independently, such that they can be decoded in
+// parallel.  Typical terrain compresses to 3-5 bits per sample.
+//
+//   header:  magic, version, dim, rows per block, number of blocks (all uint32, little endian)
+//   offsets: n_blocks+1 uint64, little endian, relative to the start of the payload
+//   payload: the blocks
+
+inline constexpr char codec_magic[4] = {'A', 'P', 'T', 'C'};
+inline constexpr uint32_t codec_version = 1;
+
+std::vector<uint8_t> encode_tile(const tile<int16_t>& t, int64_t block_rows = 64);
+
+// the tile has to have dim x dim samples, which is checked before anything is
+// allocated, and every block has to be exactly as long as its samples need
+tile<int16_t> decode_tile(std::span<const uint8_t> data, int64_t dim, LatLon<int64_t, Unit::deg> coord);
+
+void write_compressed_tile(const fs::path& fn, const tile<int16_t>& t);
+
+tile<int16_t> read_compressed_tile(const fs::path& fn, int64_t dim, LatLon<int64_t, Unit::deg> coord);
@@ -0,0 +1,125 @@
+#include "elevation_source.hh"
+#include "latlon.hh"
+#include "tile.hh"
+#include "tile_archive.hh"
+#include "tile_codec.hh"
+#include <algorithm>
+#include <filesystem>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <boost/program_options.hpp>
+
+namespace po = boost::program_options;
+namespace fs = std::filesystem;
+
+// N47E010.hgt -> {47, 10}
+std::optional<LatLon<int64_t, Unit::deg>> parse_tile_name(const std::string& stem) {
+  if (stem.size() != 7 || (stem[0] != 'N' && stem[0] != 'S') || (stem[3] != 'E' && stem[3] != 'W'))
+    return std::nullopt;
+  if (!std::all_of(stem.begin() + 1, stem.begin() + 3, ::isdigit) || !std::all_of(stem.begin() + 4, stem.end(), ::isdigit))
+    return std::nullopt;
+  const int64_t lat = convert_from_stringish<int64_t>(stem.substr(1, 2));
+  const int64_t lon = convert_from_stringish<int64_t>(stem.substr(4, 3));
+  return LatLon<int64_t, Unit::deg>(stem[0] == 'N' ? lat : -lat, stem[3] == 'E' ? lon : -lon);
+}
+
+// all .hgt files of one source, within the bounds
+std::vector<std::pair<LatLon<int64_t, Unit::deg>, fs::path>> find_tiles(const fs::path& hgt_dir, elevation_source source, int south, int north, int west, int east) {
+  std::vector<std::pair<LatLon<int64_t, Unit::deg>, fs::path>> res;
+  const fs::path dir = hgt_dir / elevation_source_folder[std::to_underlying(source)];
+  if (!fs::is_directory(dir))
+    return res;
+  for (const auto& entry : fs::directory_iterator(dir)) {
+    if (entry.path().extension() != ".hgt")
+      continue;
+    const auto coord = parse_tile_name(entry.path().stem().string());
+    if (!coord || !is_in_range(coord->lat(), south, north) || !is_in_range(coord->lon(), west, east))
+      continue;
+    res.emplace_back(*coord, entry.path());
+  }
+  std::sort(res.begin(), res.end());
+  return res;
+}
+
+int main(int ac, char** av) {
+  po::options_description desc("options");
+  // clang-format off
+  desc.add_options()("help,h", "produce help message")
+                    ("pack", po::value<std::string>(), "write all selected .hgt tiles into one archive")
+                    ("compress", "write a compressed .hgtc next to each selected .hgt tile")
+                    ("hgt", po::value<std::string>()->default_value("hgt"), "directory containing one folder per elevation source")
+                    ("source", po::value<std::vector<std::string>>()->multitoken(), "sources to include (srtm1, srtm3, view1, view3), default: all")
+                    ("south", po::value<int>()->default_value(-90), "southern bound, inclusive [deg]")
+                    ("north", po::value<int>()->default_value(90), "northern bound, exclusive [deg]")
+                    ("west", po::value<int>()->default_value(-180), "western bound, inclusive [deg]")
+                    ("east", po::value<int>()->default_value(180), "eastern bound, exclusive [deg]");
+  // clang-format on
+
+  po::variables_map vm;
+  po::store(po::parse_command_line(ac, av, desc), vm);
+  po::notify(vm);
+
+  if (vm.count("help") || (!vm.count("pack") && !vm.count("compress"))) {
+    std::cout << desc << std::endl;
+    return 1;
+  }
+
+  std::vector<elevation_source> sources({elevation_source::srtm1, elevation_source::srtm3, elevation_source::view1, elevation_source::view3});
+  if (vm.count("source")) {
+    sources.clear();
+    for (const auto& name : vm["source"].as<std::vector<std::string>>()) {
+      const auto it = std::find(elevation_source_name.begin(), elevation_source_name.end(), name);
+      if (it == elevation_source_name.end()) {
+        std::cerr << "unknown source " << name << std::endl;
+        return 1;
+      }
+      sources.push_back(elevation_source(std::distance(elevation_source_name.begin(), it)));
+    }
+  }
+
+  const fs::path hgt_dir(vm["hgt"].as<std::string>());
+  const int south = vm["south"].as<int>(), north = vm["north"].as<int>(), west = vm["west"].as<int>(), east = vm["east"].as<int>();
+
+  std::unique_ptr<tile_archive_writer> writer;
+  if (vm.count("pack"))
+    writer = std::make_unique<tile_archive_writer>(vm["pack"].as<std::string>());
+
+  int64_t n_tiles = 0;
+  uint64_t bytes_raw = 0, bytes_compressed = 0;
+  for (const auto source : sources) {
+    const int64_t tile_size = 3600 / elevation_source_resolution[std::to_underlying(source)] + 1;
+    for (const auto& [coord, fn] : find_tiles(hgt_dir, source, south, north, west, east)) {
+      std::cout << "adding " << fn.string() << std::endl;
+      const tile<int16_t> t(fn, tile_size, coord);
+      if (writer)
+        writer->add(t, source);
+      if (vm.count("compress")) {
+        const fs::path fn_compressed = fs::path(fn).replace_extension(".hgtc");
+        write_compressed_tile(fn_compressed, t);
+        // never leave a lossy file behind
+        if (!std::ranges::equal(read_compressed_tile(fn_compressed, tile_size, coord), t)) {
+          fs::remove(fn_compressed);
+          std::cerr << "round trip of " << fn.string() << " failed" << std::endl;
+          return 1;
+        }
+        bytes_raw += fs::file_size(fn);
+        bytes_compressed += fs::file_size(fn_compressed);
+      }
+      n_tiles++;
+    }
+  }
+  if (writer) {
+    writer->finish();
+    std::cout << "wrote " << n_tiles << " tiles to " << vm["pack"].as<std::string>() << std::endl;
+  }
+  if (vm.count("compress")) {
+    std::cout << "compressed " << n_tiles << " tiles from " << (bytes_raw >> 20) << " MiB to " << (bytes_compressed >> 20) << " MiB" << std::endl;
+  }
+
+  return 0;
+}